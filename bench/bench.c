@@ -0,0 +1,279 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Cycle benchmark of the bootloader's USB handlers. The firmware is built
+// with USE_BENCH_MARKERS, which writes the markers from `src/bench.h` to
+// GPIOR0, and runs under simavr. Packets are injected through simavr's USB
+// model and the cycle counts between the markers are reported.
+//
+// simavr finishes SPM and EEPROM operations instantly, so the numbers are
+// the CPU time spent in the handlers, not the time the flash is busy.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "avr_usb.h"
+
+#include "bench.h"
+
+#define F_CPU 16000000
+
+// atmega32u4
+#define GPIOR0_ADDR 0x3E
+#define FLASH_SIZE 0x8000
+#define SPM_PAGESIZE 128
+
+#define EP_SIZE_VENDOR 64
+#define EP_NUM_VENDOR_IN 1
+#define EP_NUM_VENDOR_OUT 2
+
+#define USB_CMD_SPM 3
+#define USB_CMD_WRITE_EEPROM 4
+#define SPM_HEADER_SIZE 6
+#define SEQ_TAG_POS (EP_SIZE_VENDOR-1)
+
+#define SPMEN 0
+#define PGERS 1
+#define PGWRT 2
+#define RWWSRE 4
+
+// every case is repeated this many times and the median is reported
+#define REPEAT 15
+// give up waiting for a marker after this many cycles (1s)
+#define CYCLE_LIMIT F_CPU
+
+
+typedef struct bench_result_t {
+    const char *name;
+    avr_cycle_count_t cycles;
+} bench_result_t;
+
+static avr_cycle_count_t s_marks[BENCH_MARK_COUNT];
+static uint32_t s_seen;
+
+static void on_marker(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param) {
+    avr->data[addr] = v;
+    if (v < BENCH_MARK_COUNT) {
+        s_marks[v] = avr->cycle;
+        s_seen |= (1UL << v);
+    }
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "bench: %s\n", what);
+    exit(1);
+}
+
+/// Run until the firmware writes `mark` to GPIOR0
+static void run_until(avr_t *avr, uint8_t mark) {
+    const avr_cycle_count_t limit = avr->cycle + CYCLE_LIMIT;
+    s_seen = 0;
+    while (!(s_seen & (1UL << mark))) {
+        const int state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fail("the firmware stopped");
+        }
+        if (avr->cycle > limit) {
+            fail("timed out waiting for a marker");
+        }
+    }
+}
+
+/// Run for at least `n` passes of usb_poll()
+static void run_polls(avr_t *avr, int n) {
+    while (n--) {
+        run_until(avr, BENCH_MARK_POLL_END);
+    }
+}
+
+static void usb_out(avr_t *avr, uint8_t pipe, const uint8_t *data, uint32_t sz) {
+    struct avr_io_usb io = { .pipe = pipe, .sz = sz, .buf = (uint8_t*)data };
+    while (avr_ioctl(avr, AVR_IOCTL_USB_WRITE, &io) == AVR_IOCTL_USB_NAK) {
+        run_polls(avr, 1);
+    }
+}
+
+static uint32_t usb_in(avr_t *avr, uint8_t pipe, uint8_t *data, uint32_t sz) {
+    struct avr_io_usb io = { .pipe = pipe, .sz = sz, .buf = data };
+    while (avr_ioctl(avr, AVR_IOCTL_USB_READ, &io) == AVR_IOCTL_USB_NAK) {
+        run_polls(avr, 1);
+        io.sz = sz;
+    }
+    return io.sz;
+}
+
+static int cmp_cycles(const void *a, const void *b) {
+    const avr_cycle_count_t x = *(const avr_cycle_count_t*)a;
+    const avr_cycle_count_t y = *(const avr_cycle_count_t*)b;
+    return (x > y) - (x < y);
+}
+
+static avr_cycle_count_t median(avr_cycle_count_t *samples) {
+    qsort(samples, REPEAT, sizeof(samples[0]), cmp_cycles);
+    return samples[REPEAT/2];
+}
+
+/// Cycles spent in usb_handle_cmd() for the command in `packet`. With
+/// `invert`, the payload is inverted before every packet so that the data
+/// always differs from what was written before.
+static avr_cycle_count_t bench_cmd(avr_t *avr, uint8_t *packet, int invert) {
+    avr_cycle_count_t samples[REPEAT];
+    uint8_t resp[EP_SIZE_VENDOR];
+    for (int i = 0; i < REPEAT; ++i) {
+        for (int j = SPM_HEADER_SIZE; invert && j < packet[5]; ++j) {
+            packet[j] ^= 0xff;
+        }
+        packet[SEQ_TAG_POS] = i;
+        usb_out(avr, EP_NUM_VENDOR_OUT, packet, EP_SIZE_VENDOR);
+        run_until(avr, BENCH_MARK_CMD_END);
+        samples[i] = s_marks[BENCH_MARK_CMD_END] - s_marks[BENCH_MARK_CMD_START];
+        usb_in(avr, EP_NUM_VENDOR_IN, resp, sizeof(resp));
+    }
+    return median(samples);
+}
+
+static avr_cycle_count_t bench_idle_poll(avr_t *avr) {
+    avr_cycle_count_t samples[REPEAT];
+    for (int i = 0; i < REPEAT; ++i) {
+        run_until(avr, BENCH_MARK_POLL_START);
+        run_until(avr, BENCH_MARK_POLL_END);
+        samples[i] = s_marks[BENCH_MARK_POLL_END] - s_marks[BENCH_MARK_POLL_START];
+    }
+    return median(samples);
+}
+
+/// GET_DESCRIPTOR(device) on endpoint 0, from the setup packet until the
+/// descriptor is in the IN bank
+static avr_cycle_count_t bench_ep0_descriptor(avr_t *avr) {
+    static const uint8_t setup[8] = { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 };
+    avr_cycle_count_t samples[REPEAT];
+    uint8_t desc[EP_SIZE_VENDOR];
+    for (int i = 0; i < REPEAT; ++i) {
+        struct avr_io_usb io = { .pipe = 0, .sz = sizeof(setup), .buf = (uint8_t*)setup };
+        avr_ioctl(avr, AVR_IOCTL_USB_SETUP, &io);
+        run_until(avr, BENCH_MARK_EP0_END);
+        samples[i] = s_marks[BENCH_MARK_EP0_END] - s_marks[BENCH_MARK_EP0_START];
+        usb_in(avr, 0, desc, sizeof(desc));
+        // status stage
+        usb_out(avr, 0, NULL, 0);
+    }
+    return median(samples);
+}
+
+static void spm_packet(uint8_t *packet, uint16_t addr, uint8_t action, uint8_t action2, uint8_t size) {
+    memset(packet, 0, EP_SIZE_VENDOR);
+    packet[0] = USB_CMD_SPM;
+    packet[1] = addr & 0xff;
+    packet[2] = addr >> 8;
+    packet[3] = action;
+    packet[4] = action2;
+    packet[5] = size;
+}
+
+static avr_t *bench_load(elf_firmware_t *firmware) {
+    avr_t *avr = avr_make_mcu_by_name("atmega32u4");
+    if (!avr) {
+        fail("simavr doesn't support the atmega32u4");
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, firmware);
+    avr->frequency = F_CPU;
+    // BOOTRST is programmed, execution starts in the bootloader
+    avr->pc = avr->reset_pc = firmware->flashbase;
+    avr->log = LOG_ERROR;
+    return avr;
+}
+
+/// Cycles from a power on reset until the first instruction of the
+/// application, when there is one
+static avr_cycle_count_t bench_reset_to_app(elf_firmware_t *firmware) {
+    avr_t *avr = bench_load(firmware);
+    // rjmp .-2 at the reset vector of the application
+    avr->flash[0] = 0xff;
+    avr->flash[1] = 0xcf;
+    while (avr->pc != 0) {
+        const int state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fail("the firmware stopped");
+        }
+        if (avr->cycle > CYCLE_LIMIT) {
+            fail("the application wasn't started");
+        }
+    }
+    const avr_cycle_count_t cycles = avr->cycle;
+    avr_terminate(avr);
+    return cycles;
+}
+
+int main(int argc, char *argv[]) {
+    elf_firmware_t firmware;
+    bench_result_t results[8];
+    int count = 0;
+    uint8_t packet[EP_SIZE_VENDOR];
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s firmware.elf\n", argv[0]);
+        return 1;
+    }
+
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[1], &firmware)) {
+        fail("can't read the firmware");
+    }
+
+    results[count].name = "reset_to_app";
+    results[count++].cycles = bench_reset_to_app(&firmware);
+
+    // the flash is empty from here on, so the bootloader stays in control
+    avr_t *avr = bench_load(&firmware);
+    avr_register_io_write(avr, GPIOR0_ADDR, on_marker, NULL);
+
+    // usb_init() has to enable the pads before VBUS is seen
+    run_until(avr, BENCH_MARK_POLL_START);
+    avr_ioctl(avr, AVR_IOCTL_USB_VBUS, (void*)1);
+    avr_ioctl(avr, AVR_IOCTL_USB_RESET, NULL);
+    run_polls(avr, 4);
+
+    results[count].name = "idle_poll";
+    results[count++].cycles = bench_idle_poll(avr);
+
+    results[count].name = "ep0_get_descriptor";
+    results[count++].cycles = bench_ep0_descriptor(avr);
+
+    // The application section is used, so the sequence matches what the
+    // host sends when writing a page.
+    const uint16_t page = FLASH_SIZE / 2;
+
+    spm_packet(packet, page, (1<<SPMEN), 0, SEQ_TAG_POS - 1);
+    for (int i = SPM_HEADER_SIZE; i < SEQ_TAG_POS - 1; ++i) {
+        packet[i] = i;
+    }
+    results[count].name = "spm_fill";
+    results[count++].cycles = bench_cmd(avr, packet, 0);
+
+    spm_packet(packet, page, (1<<SPMEN)|(1<<PGERS), (1<<SPMEN)|(1<<RWWSRE), SPM_HEADER_SIZE+1);
+    results[count].name = "spm_erase";
+    results[count++].cycles = bench_cmd(avr, packet, 0);
+
+    spm_packet(packet, page, (1<<SPMEN)|(1<<PGWRT), (1<<SPMEN)|(1<<RWWSRE), SPM_HEADER_SIZE+1);
+    results[count].name = "spm_write";
+    results[count++].cycles = bench_cmd(avr, packet, 0);
+
+    memset(packet, 0, sizeof(packet));
+    packet[0] = USB_CMD_WRITE_EEPROM;
+    packet[5] = SEQ_TAG_POS - 1;
+    results[count].name = "write_eeprom";
+    results[count++].cycles = bench_cmd(avr, packet, 1);
+
+    for (int i = 0; i < count; ++i) {
+        printf("%-20s %8llu\n", results[i].name, (unsigned long long)results[i].cycles);
+    }
+
+    avr_terminate(avr);
+    return 0;
+}
@@ -4,3 +4,18 @@ endif
 ifndef BOOT_SIZE
   BOOT_SIZE = 4096
 endif
+
+# optional bootloader features
+USE_WRITE_PAGE ?= 1
+USE_ERASE_CMD ?= 1
+USE_EEPROM_UPDATE ?= 1
+USE_SPM_FIFO ?= 1
+USE_READ_CMD ?= 1
+USE_CRC_CMD ?= 1
+USE_PAGE_STAGING ?= 1
+USE_EEPROM_QUEUE ?= 1
+USE_WRITE_PAGE_LZ ?= 1
+USE_BULK_ENDPOINTS ?= 1
+USE_CONTROL_PAGE ?= 1
+USE_SERIAL_NUMBER ?= 1
+USE_BOOT_SERVICES ?= 1
@@ -4,6 +4,8 @@
 
 #include "kp_boot_32u4.h"
 
+#include <avr/pgmspace.h>
+
 /// Interface to the SPM instruction in the bootloader section.
 ///
 /// Parameters:
@@ -89,3 +91,77 @@ void spm_write_page(uint16_t addr) {
         0
     );
 }
+
+/// Word address of the service `n` in the boot service table, for use as a
+/// function pointer.
+#define BOOT_SERVICE_ENTRY(n) ((uint16_t)((BOOT_SERVICE_ADDRESS + 4 + 4*(n)) / 2))
+
+/// Returns the version of the boot service table, or 0 if the bootloader
+/// doesn't have one. kp_boot_write_page() and kp_boot_crc() need version 1.
+uint8_t kp_boot_service_version(void) {
+    if (pgm_read_word((uint16_t)BOOT_SERVICE_ADDRESS) != BOOT_SERVICE_MAGIC) {
+        return 0;
+    }
+    return pgm_read_byte((uint16_t)BOOT_SERVICE_ADDRESS + 2);
+}
+
+/// Program a whole page from SRAM with one call into the bootloader. The
+/// page is only erased if the new data sets bits that are clear, and isn't
+/// touched at all if it already holds the data. Interrupts are disabled
+/// while the flash is busy.
+///
+/// Parameters:
+/// * page_addr: byte address of the start of the page
+/// * buf: SPM_PAGESIZE bytes of data
+///
+/// Returns one of KP_BOOT_PAGE_*.
+uint8_t kp_boot_write_page(uint16_t page_addr, const void *buf) {
+    uint8_t (*const write_page)(uint16_t, const void*) =
+        (uint8_t (*)(uint16_t, const void*))BOOT_SERVICE_ENTRY(0);
+    return write_page(page_addr, buf);
+}
+
+/// CRC-16/CCITT (polynomial 0x1021, initial value 0xffff) of `length` bytes
+/// of flash starting at `addr`, computed by the bootloader.
+uint16_t kp_boot_crc(uint16_t addr, uint16_t length) {
+    uint16_t (*const crc)(uint16_t, uint16_t) =
+        (uint16_t (*)(uint16_t, uint16_t))BOOT_SERVICE_ENTRY(1);
+    return crc(addr, length);
+}
+
+/// Returns true if the bootloader can keep interrupts running while the
+/// flash is busy, see kp_rww_isr_t. Otherwise spm_erase_page_isr() and
+/// spm_write_page_isr() must not be called.
+uint8_t kp_boot_has_rww_isr(void) {
+    return kp_boot_service_version() &&
+        pgm_read_byte((uint16_t)BOOT_SERVICE_ADDRESS + 3) > 2;
+}
+
+/// Like spm_leap_cmd(), but through the bootloader's boot_service_spm()
+static void spm_isr_cmd(uint16_t addr, uint8_t spmCmd, uint8_t spmCmd2, uint16_t optValue) {
+    void (*const spm)(uint16_t, uint8_t, uint8_t, uint16_t) =
+        (void (*)(uint16_t, uint8_t, uint8_t, uint16_t))BOOT_SERVICE_ENTRY(2);
+    spm(addr, spmCmd, spmCmd2, optValue);
+}
+
+/// Same as spm_erase_page(), but the interrupts registered with
+/// kp_boot_rww_isr_register() keep running while the flash is busy.
+void spm_erase_page_isr(uint16_t addr) {
+    spm_isr_cmd(
+        addr,
+        (1<<SPMEN) | (1<<PGERS),
+        (1<<SPMEN) | (1<<RWWSRE),
+        0
+    );
+}
+
+/// Same as spm_write_page(), but the interrupts registered with
+/// kp_boot_rww_isr_register() keep running while the flash is busy.
+void spm_write_page_isr(uint16_t addr) {
+    spm_isr_cmd(
+        addr,
+        (1<<SPMEN) | (1<<PGWRT),
+        (1<<SPMEN) | (1<<RWWSRE),
+        0
+    );
+}
@@ -17,6 +17,63 @@
 #define SPM_INTERFACE_SIZE      16
 #define SPM_INTERFACE_ADDRESS   ((((uint32_t)FLASHEND+1) - SPM_INTERFACE_SIZE))
 
+// Table of services in 4kb bootloaders, right below the SPM interface
+#define BOOT_SERVICE_SIZE       16
+#define BOOT_SERVICE_ADDRESS    (SPM_INTERFACE_ADDRESS - BOOT_SERVICE_SIZE)
+#define BOOT_SERVICE_MAGIC      0xb007
+
+// Results of kp_boot_write_page()
+enum {
+    KP_BOOT_PAGE_BAD_ADDRESS = 0, // not a page in the application section
+    KP_BOOT_PAGE_SKIPPED = 1,     // flash already holds the data
+    KP_BOOT_PAGE_WRITTEN = 2,     // only bits were cleared, no erase needed
+    KP_BOOT_PAGE_ERASED = 3,      // the page was erased and then written
+};
+
+// What the bootloader does with the interrupts while spm_erase_page_isr()
+// and spm_write_page_isr() keep the application section busy. The vectors
+// are moved to the boot section for that time, so the application's own
+// handlers can't run:
+//
+// * TIMER0_COMPA: counts `ticks`
+// * USB start of frame: counts `frames`
+// * USB endpoint `in_ep`: sends `report` if `report_pending` is set, and
+//   then clears it
+//
+// The other USB interrupts are masked until the command is done. Any other
+// interrupt disables interrupts for the rest of the command. The application
+// only takes it afterwards if its flag is still set, so interrupts whose flag
+// is cleared when the vector is taken, like the other timer interrupts, are
+// lost.
+//
+// `magic` is set by kp_boot_rww_isr_register(), and also identifies the
+// layout of the structure. If GPIOR1:GPIOR2 don't point at one with the
+// right value, the bootloader disables interrupts for the whole command.
+#define KP_RWW_ISR_MAGIC 0x1a01
+
+typedef struct {
+    uint16_t magic;
+    volatile uint16_t ticks;
+    volatile uint16_t frames;
+    uint8_t in_ep;
+    uint8_t report_len;
+    volatile uint8_t report_pending;
+    const uint8_t *report;
+} kp_rww_isr_t;
+
+/// Register `isr` for spm_erase_page_isr() and spm_write_page_isr(). Its
+/// address is kept in GPIOR1:GPIOR2, so the application can't use them for
+/// anything else. NULL unregisters it, and then interrupts are disabled
+/// while the flash is busy.
+static inline
+void kp_boot_rww_isr_register(kp_rww_isr_t *isr) {
+    if (isr) {
+        isr->magic = KP_RWW_ISR_MAGIC;
+    }
+    GPIOR1 = (uint16_t)isr & 0xff;
+    GPIOR2 = (uint16_t)isr >> 8;
+}
+
 /// Jump to the bootloader by using a watch dog reset
 static inline
 void kp_boot_jmp(void) {
@@ -40,3 +97,11 @@ void kp_boot_reset(void) {
 void spm_erase_page(uint16_t addr);
 void spm_load_temporary_buffer(uint8_t offset, uint16_t data_word);
 void spm_write_page(uint16_t addr);
+
+uint8_t kp_boot_service_version(void);
+uint8_t kp_boot_write_page(uint16_t page_addr, const void *buf);
+uint16_t kp_boot_crc(uint16_t addr, uint16_t length);
+
+uint8_t kp_boot_has_rww_isr(void);
+void spm_erase_page_isr(uint16_t addr);
+void spm_write_page_isr(uint16_t addr);
@@ -0,0 +1,420 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+/// @file
+///
+/// Log structured key/value store, see kp_kvstore.h.
+///
+/// Page layout:
+///
+/// data[0:1]: sequence number, one more than the page before it in the log
+/// data[2:3]: complement of the sequence number
+/// data[4]: 0x00 once the records of the oldest page have been copied here
+/// data[5:...]: records, until the first 0xff key
+///
+/// Record layout:
+///
+/// data[0]: key
+/// data[1]: length of the value, 0 deletes the key
+/// data[2:...]: the value
+/// data[2+length:3+length]: CRC-16 of the key, length and value
+///
+/// A page whose header doesn't match is treated as free, and a record whose
+/// CRC doesn't match ends its page. Both can be left by a reset in the
+/// middle of programming or erasing. Erasing only sets bits, so it can't make
+/// a header match. The CRC is 16 bits, since a record that was cut short
+/// could otherwise pass for a record of any key.
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+
+#include "kp_boot_32u4.h"
+#include "kp_kvstore.h"
+
+#define KV_FREE_KEY 0xff
+#define KV_HEADER_COMPACTED 4
+#define KV_NO_RECORD 0
+
+typedef struct {
+    uint8_t key;
+    uint8_t length;
+    // the value in SRAM, or its flash address when `in_flash` is set
+    const uint8_t *value;
+    bool in_flash;
+    uint16_t crc;
+} kv_record_t;
+
+static uint16_t s_first;        // address of the first page
+static uint8_t s_page_count;
+static uint8_t s_head;          // page that records are appended to
+static uint8_t s_head_pos;      // offset of the free space in the head page
+static uint16_t s_head_seq;
+static uint8_t s_tail;          // oldest page of the log
+static uint16_t s_live;         // bytes used by the current records
+static bool s_rww_isr;          // the bootloader has spm_write_page_isr()
+// flash address of the current record of each key, or KV_NO_RECORD
+static uint16_t s_index[KV_MAX_KEYS];
+
+static uint16_t page_address(uint8_t page) {
+    return s_first + (uint16_t)page * SPM_PAGESIZE;
+}
+
+static uint8_t next_page(uint8_t page) {
+    return (page + 1 == s_page_count) ? 0 : page + 1;
+}
+
+static uint8_t prev_page(uint8_t page) {
+    return (page == 0) ? s_page_count - 1 : page - 1;
+}
+
+static uint8_t record_size(uint8_t length) {
+    return length + KV_RECORD_OVERHEAD;
+}
+
+/// Returns true and the sequence number in `seq` if `page` is part of the
+/// log.
+static bool page_in_use(uint8_t page, uint16_t *seq) {
+    const uint16_t addr = page_address(page);
+    *seq = pgm_read_word(addr);
+    return (uint16_t)(*seq ^ pgm_read_word(addr + 2)) == 0xffff;
+}
+
+/// Returns true if the page at `addr` is erased from `pos` to its end
+static bool page_is_blank(uint16_t addr, uint8_t pos) {
+    for (; pos < SPM_PAGESIZE; ++pos) {
+        if (pgm_read_byte(addr + pos) != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Returns the size of the record at `pos` in the page at `addr`, or 0 if
+/// there is no complete record there.
+static uint8_t record_at(uint16_t addr, uint8_t pos) {
+    if (pos + KV_RECORD_OVERHEAD > SPM_PAGESIZE ||
+        pgm_read_byte(addr + pos) == KV_FREE_KEY) {
+        return 0;
+    }
+    const uint8_t length = pgm_read_byte(addr + pos + 1);
+    if (pos + KV_RECORD_OVERHEAD + length > SPM_PAGESIZE) {
+        return 0;
+    }
+    uint16_t crc = 0xffff;
+    for (uint8_t i = 0; i < length + 2; ++i) {
+        crc = _crc_xmodem_update(crc, pgm_read_byte(addr + pos + i));
+    }
+    if (crc != pgm_read_word(addr + pos + length + 2)) {
+        return 0;
+    }
+    return record_size(length);
+}
+
+/// Byte `i` of the record as it is stored in flash
+static uint8_t record_byte(const kv_record_t *rec, uint8_t i) {
+    if (i == 0) {
+        return rec->key;
+    } else if (i == 1) {
+        return rec->length;
+    } else if (i - 2 == rec->length) {
+        return rec->crc & 0xff;
+    } else if (i - 3 == rec->length) {
+        return rec->crc >> 8;
+    } else if (rec->in_flash) {
+        return pgm_read_byte((uint16_t)rec->value + i - 2);
+    } else {
+        return rec->value[i - 2];
+    }
+}
+
+static void record_update_crc(kv_record_t *rec) {
+    rec->crc = 0xffff;
+    for (uint8_t i = 0; i < rec->length + 2; ++i) {
+        rec->crc = _crc_xmodem_update(rec->crc, record_byte(rec, i));
+    }
+}
+
+/// Load the temporary page buffer with `size` bytes from `get` at `pos`, and
+/// 0xff everywhere else.
+static void fill_buffer(
+    uint8_t pos, uint8_t size,
+    uint8_t (*get)(const void*, uint8_t), const void *ctx
+) {
+    for (uint8_t offset = 0; offset < SPM_PAGESIZE; offset += 2) {
+        uint16_t word = 0xffff;
+        for (uint8_t i = 0; i < 2; ++i) {
+            const uint8_t byte_pos = offset + i;
+            if (byte_pos >= pos && byte_pos < pos + size) {
+                const uint8_t value = get(ctx, byte_pos - pos);
+                word &= ~(0xff << (8*i)) | ((uint16_t)value << (8*i));
+            }
+        }
+        spm_load_temporary_buffer(offset, word);
+    }
+}
+
+/// Program `size` bytes from `get` at `pos` in the page at `addr`. The rest
+/// of the page is programmed with 0xff, so its other bytes don't change and
+/// no erase is needed.
+static void program_bytes(
+    uint16_t addr, uint8_t pos, uint8_t size,
+    uint8_t (*get)(const void*, uint8_t), const void *ctx
+) {
+    if (s_rww_isr) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            fill_buffer(pos, size, get, ctx);
+        }
+        spm_write_page_isr(addr);
+        return;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        fill_buffer(pos, size, get, ctx);
+        spm_write_page(addr);
+    }
+}
+
+static void erase_page(uint16_t addr) {
+    if (s_rww_isr) {
+        spm_erase_page_isr(addr);
+        return;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        spm_erase_page(addr);
+    }
+}
+
+static uint8_t header_byte(const void *ctx, uint8_t i) {
+    const uint16_t seq = *(const uint16_t*)ctx;
+    const uint16_t word = (i < 2) ? seq : ~seq;
+    if (i == KV_HEADER_COMPACTED) {
+        return 0xff;
+    }
+    return (i & 1) ? (word >> 8) : (word & 0xff);
+}
+
+static uint8_t zero_byte(const void *ctx, uint8_t i) {
+    (void)ctx;
+    (void)i;
+    return 0x00;
+}
+
+static uint8_t get_record_byte(const void *ctx, uint8_t i) {
+    return record_byte((const kv_record_t*)ctx, i);
+}
+
+/// Update the index for a record of `length` bytes at `addr`
+static void index_record(uint8_t key, uint16_t addr, uint8_t length) {
+    if (key >= KV_MAX_KEYS) {
+        return;
+    }
+    const uint16_t old = s_index[key];
+    if (old != KV_NO_RECORD) {
+        s_live -= record_size(pgm_read_byte(old + 1));
+    }
+    if (length) {
+        s_index[key] = addr;
+        s_live += record_size(length);
+    } else {
+        s_index[key] = KV_NO_RECORD;
+    }
+}
+
+/// Start appending to `page`, erasing it first if needed
+static void open_page(uint8_t page) {
+    const uint16_t addr = page_address(page);
+    if (!page_is_blank(addr, 0)) {
+        erase_page(addr);
+    }
+    s_head_seq++;
+    program_bytes(addr, 0, KV_PAGE_HEADER_SIZE, header_byte, &s_head_seq);
+    s_head = page;
+    s_head_pos = KV_PAGE_HEADER_SIZE;
+}
+
+/// Program `rec` in the head page, which must have room for it
+static void append_to_head(const kv_record_t *rec) {
+    const uint16_t addr = page_address(s_head) + s_head_pos;
+    program_bytes(
+        page_address(s_head), s_head_pos, record_size(rec->length),
+        get_record_byte, rec
+    );
+    index_record(rec->key, addr, rec->length);
+    s_head_pos += record_size(rec->length);
+}
+
+/// Copy the current records in the oldest page to the head page and erase
+/// it. Deleted keys and values that have been replaced are dropped.
+static void compact_tail(void) {
+    const uint16_t addr = page_address(s_tail);
+    uint8_t pos = KV_PAGE_HEADER_SIZE;
+    uint8_t size;
+
+    while ((size = record_at(addr, pos))) {
+        const uint8_t key = pgm_read_byte(addr + pos);
+        if (key < KV_MAX_KEYS && s_index[key] == addr + pos) {
+            if (SPM_PAGESIZE - s_head_pos < size) {
+                // never erase a record that has nowhere to go
+                return;
+            }
+            kv_record_t rec = {
+                .key = key,
+                .length = size - KV_RECORD_OVERHEAD,
+                .value = (const uint8_t*)(addr + pos + 2),
+                .in_flash = true,
+                .crc = pgm_read_word(addr + pos + size - 2),
+            };
+            append_to_head(&rec);
+        }
+        pos += size;
+    }
+    // mark the copy as done before the erase can destroy the originals
+    program_bytes(
+        page_address(s_head), KV_HEADER_COMPACTED, 1, zero_byte, NULL
+    );
+    erase_page(addr);
+    s_tail = next_page(s_tail);
+}
+
+/// Append `rec`, moving on to the next page if the head page is full. One
+/// page is always kept free, so the oldest page is compacted whenever the
+/// last free page is opened.
+static uint8_t append(const kv_record_t *rec) {
+    const uint8_t size = record_size(rec->length);
+    for (uint8_t tries = 0; SPM_PAGESIZE - s_head_pos < size; ++tries) {
+        if (next_page(s_head) == s_tail || tries == 2*s_page_count) {
+            return KV_ERR_FULL;
+        }
+        open_page(next_page(s_head));
+        if (next_page(s_head) == s_tail) {
+            compact_tail();
+        }
+    }
+    append_to_head(rec);
+    return KV_OK;
+}
+
+/// Find the log in `page_count` pages starting at `first_page` and build
+/// the index. Needs at least 3 pages. The store is only usable after this
+/// returns KV_OK.
+uint8_t kv_init(uint16_t first_page, uint8_t page_count) {
+    if (page_count < 3 || (first_page & (SPM_PAGESIZE-1))) {
+        return KV_ERR_ARG;
+    }
+    s_first = first_page;
+    s_page_count = page_count;
+    s_rww_isr = kp_boot_has_rww_isr();
+    s_live = 0;
+    memset(s_index, 0, sizeof(s_index));
+
+    // The log is a run of pages with consecutive sequence numbers. Find its
+    // two ends.
+    bool found = false;
+    for (uint8_t page = 0; page < page_count; ++page) {
+        uint16_t seq;
+        uint16_t other;
+        if (!page_in_use(page, &seq)) {
+            continue;
+        }
+        found = true;
+        if (!page_in_use(next_page(page), &other) || other != (uint16_t)(seq+1)) {
+            s_head = page;
+            s_head_seq = seq;
+        }
+        if (!page_in_use(prev_page(page), &other) || other != (uint16_t)(seq-1)) {
+            s_tail = page;
+        }
+    }
+
+    if (!found) {
+        s_tail = 0;
+        s_head_seq = 0xffff;
+        open_page(0);
+        return KV_OK;
+    }
+
+    // replay the records from the oldest to the newest
+    uint8_t page = s_tail;
+    for (uint8_t i = 0; i < page_count; ++i) {
+        const uint16_t addr = page_address(page);
+        uint8_t pos = KV_PAGE_HEADER_SIZE;
+        uint8_t size;
+        while ((size = record_at(addr, pos))) {
+            index_record(pgm_read_byte(addr + pos), addr + pos, size - KV_RECORD_OVERHEAD);
+            pos += size;
+        }
+        if (page == s_head) {
+            // don't append after a record that was cut short
+            s_head_pos = page_is_blank(addr, pos) ? pos : SPM_PAGESIZE;
+            break;
+        }
+        page = next_page(page);
+    }
+
+    // A reset during compaction leaves no free page. If the copy was done,
+    // finish erasing the oldest page. Otherwise the oldest page is still
+    // whole and the head page only holds copies of its records, so drop the
+    // head page instead.
+    if (next_page(s_head) == s_tail) {
+        if (pgm_read_byte(page_address(s_head) + KV_HEADER_COMPACTED) == 0x00) {
+            erase_page(page_address(s_tail));
+        } else {
+            erase_page(page_address(s_head));
+        }
+        return kv_init(first_page, page_count);
+    }
+    return KV_OK;
+}
+
+/// Copy up to `size` bytes of the value of `key` to `buf`. Returns the
+/// length of the value, or 0 if the key isn't set.
+uint8_t kv_read(uint8_t key, void *buf, uint8_t size) {
+    if (key >= KV_MAX_KEYS || s_index[key] == KV_NO_RECORD) {
+        return 0;
+    }
+    const uint16_t addr = s_index[key];
+    const uint8_t length = pgm_read_byte(addr + 1);
+    memcpy_P(buf, (const void*)(addr + 2), (size < length) ? size : length);
+    return length;
+}
+
+/// Set the value of `key`. Nothing is programmed if it doesn't change. A
+/// `length` of 0 deletes the key.
+uint8_t kv_write(uint8_t key, const void *data, uint8_t length) {
+    if (key >= KV_MAX_KEYS || length > KV_MAX_VALUE_SIZE || s_page_count == 0) {
+        return KV_ERR_ARG;
+    }
+
+    const uint16_t old = s_index[key];
+    const uint8_t old_length = (old != KV_NO_RECORD) ? pgm_read_byte(old + 1) : 0;
+    if (old_length == length &&
+        (length == 0 || memcmp_P(data, (const void*)(old + 2), length) == 0)) {
+        return KV_OK;
+    }
+
+    // Keep the current values within all but two pages, so that compacting
+    // the oldest page always frees some space.
+    const uint16_t capacity =
+        (uint16_t)(s_page_count - 2) * (SPM_PAGESIZE - KV_PAGE_HEADER_SIZE);
+    const uint16_t live = s_live
+        - (old_length ? record_size(old_length) : 0)
+        + (length ? record_size(length) : 0);
+    if (live > capacity) {
+        return KV_ERR_FULL;
+    }
+
+    kv_record_t rec = {
+        .key = key,
+        .length = length,
+        .value = data,
+        .in_flash = false,
+    };
+    record_update_crc(&rec);
+    return append(&rec);
+}
+
+uint8_t kv_delete(uint8_t key) {
+    return kv_write(key, NULL, 0);
+}
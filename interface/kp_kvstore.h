@@ -0,0 +1,48 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+/// @file
+///
+/// Key/value store in the application's flash, written through the SPM
+/// interface of the bootloader.
+///
+/// Values are appended to a log that spans a range of flash pages, so a
+/// small update only programs the bytes of one record, without erasing
+/// anything. The pages are used in turn, and the oldest one is erased only
+/// once the log has wrapped around to it, after its current values have been
+/// copied to the newest page. An index of the current records is kept in
+/// SRAM and rebuilt by kv_init().
+///
+/// Interrupts are disabled while the flash is being programmed, unless the
+/// bootloader can serve them, see kp_rww_isr_t.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <avr/io.h>
+
+/// Number of keys, each takes 2 bytes of SRAM for the index
+#ifndef KV_MAX_KEYS
+#define KV_MAX_KEYS 32
+#endif
+
+#if KV_MAX_KEYS > 0xfe
+#error "keys must be less than 0xff"
+#endif
+
+// Each page starts with its sequence number, its complement and a flag
+#define KV_PAGE_HEADER_SIZE 5
+// Each record is the key, the length, the value and a CRC-16
+#define KV_RECORD_OVERHEAD 4
+#define KV_MAX_VALUE_SIZE (SPM_PAGESIZE - KV_PAGE_HEADER_SIZE - KV_RECORD_OVERHEAD)
+
+enum {
+    KV_OK = 0,
+    KV_ERR_ARG = 1,     // bad key, length or page range
+    KV_ERR_FULL = 2,    // the current values don't leave room for this one
+};
+
+uint8_t kv_init(uint16_t first_page, uint8_t page_count);
+uint8_t kv_read(uint8_t key, void *buf, uint8_t size);
+uint8_t kv_write(uint8_t key, const void *data, uint8_t length);
+uint8_t kv_delete(uint8_t key);
@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# Copyright 2018 jem@seethis.link
+# Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+"""
+libusb transport for the bootloader's bulk interface.
+
+Bootloaders built with USE_BULK_ENDPOINTS have a second, vendor class
+interface with bulk endpoints that accepts the same commands as the HID
+interface. Bulk transfers aren't limited to one packet per frame, so it is
+faster when the host can use it. This needs pyusb, which is optional.
+"""
+
+from __future__ import absolute_import, division, print_function, unicode_literals
+
+import os
+
+try:
+    import usb.core
+    import usb.util
+    HAVE_PYUSB = True
+except ImportError:
+    HAVE_PYUSB = False
+
+from kp_boot_32u4.constants import *
+
+# milliseconds to wait for a single packet
+BULK_TIMEOUT = 1000
+
+def hidraw_port_path(hid_path):
+    """
+    Returns the sysfs name of the USB port a hidraw device is connected to,
+    e.g. "1-2.3", or None if it can't be found. Only works on Linux.
+    """
+    if isinstance(hid_path, bytes):
+        hid_path = hid_path.decode('utf-8')
+    if not hid_path.startswith("/dev/hidraw"):
+        return None
+    device = os.path.join("/sys/class/hidraw", os.path.basename(hid_path), "device")
+    if not os.path.exists(device):
+        return None
+    # device -> .../1-2.3/1-2.3:1.0/0003:1209:BB05.0001
+    hid_dir = os.path.realpath(device)
+    return os.path.basename(os.path.dirname(os.path.dirname(hid_dir)))
+
+def usb_port_path(usb_dev):
+    """The sysfs name of the USB port a pyusb device is connected to"""
+    ports = usb_dev.port_numbers or []
+    return "{}-{}".format(usb_dev.bus, ".".join(str(p) for p in ports))
+
+def find_bulk_device(hid_dev, vid=USB_VID, pid=USB_PID):
+    """
+    Returns a `BulkTransport` for the bulk interface of the same device as
+    `hid_dev`, or None if the bootloader doesn't have one or it can't be
+    matched.
+    """
+    if not HAVE_PYUSB:
+        return None
+    port = hidraw_port_path(hid_dev.path)
+    if port is None:
+        return None
+
+    for usb_dev in usb.core.find(find_all=True, idVendor=vid, idProduct=pid):
+        if usb_port_path(usb_dev) != port:
+            continue
+        try:
+            cfg = usb_dev.get_active_configuration()
+        except usb.core.USBError:
+            return None
+        intf = usb.util.find_descriptor(
+            cfg,
+            bInterfaceNumber = INTERFACE_BULK,
+            bInterfaceClass = USB_CLASS_VENDOR
+        )
+        if intf is None:
+            return None
+        return BulkTransport(
+            usb_dev, hid_dev.path, getattr(hid_dev, "serial_number", None)
+        )
+    return None
+
+class BulkTransport(object):
+    """
+    Talks to the bulk interface with the same methods that `BootloaderDevice`
+    uses on an `easyhid.Device`.
+    """
+    transport = "bulk"
+    max_in_flight = BULK_MAX_IN_FLIGHT
+
+    def __init__(self, usb_dev, path, serial_number=None):
+        self._usb_dev = usb_dev
+        self.path = path
+        self.serial_number = serial_number
+
+    def open(self):
+        usb.util.claim_interface(self._usb_dev, INTERFACE_BULK)
+        # throw away responses left over from an earlier session
+        try:
+            while True:
+                self._usb_dev.read(USB_DIR_IN | EP_NUM_BULK_IN, EP_SIZE_VENDOR, 10)
+        except usb.core.USBError:
+            pass
+
+    def close(self):
+        usb.util.release_interface(self._usb_dev, INTERFACE_BULK)
+        usb.util.dispose_resources(self._usb_dev)
+
+    def __enter__(self):
+        self.open()
+        return self
+
+    def __exit__(self, err_type, err_value, traceback):
+        self.close()
+
+    def write(self, data):
+        self._usb_dev.write(EP_NUM_BULK_OUT, bytes(data), BULK_TIMEOUT)
+
+    def read(self, timeout=None):
+        """Read one packet, `timeout` is in milliseconds"""
+        try:
+            return bytearray(self._usb_dev.read(
+                USB_DIR_IN | EP_NUM_BULK_IN, EP_SIZE_VENDOR,
+                timeout or BULK_TIMEOUT
+            ))
+        except usb.core.USBTimeoutError:
+            return bytearray()
+
+    def description(self):
+        return "bulk interface at {} ({})".format(
+            usb_port_path(self._usb_dev), self.path
+        )
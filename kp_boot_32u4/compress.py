@@ -0,0 +1,98 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# Copyright 2018 jem@seethis.link
+# Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+"""
+Compressor for USB_CMD_WRITE_PAGE_LZ.
+
+The format is a byte oriented LZ77 variant that is cheap to decode on the
+device. Each token starts with a control byte `c`:
+
+* `c < 0x80`: a literal run, the next `c+1` bytes are copied to the output.
+* `c >= 0x80`: a match, `(c & 0x7f) + LZ_MIN_MATCH` bytes are copied from
+  `d+1` bytes back in the output, where `d` is the byte after `c`. The copy
+  may overlap the bytes it produces, so a distance of 1 repeats one byte.
+
+Matches can only refer to the page being written, so every page is
+compressed on its own.
+"""
+
+from __future__ import absolute_import, division, print_function, unicode_literals
+
+from kp_boot_32u4.constants import *
+
+def _longest_match(data, pos):
+    best_len = 0
+    best_dist = 0
+    max_len = min(LZ_MAX_MATCH, len(data) - pos)
+    for dist in range(1, min(pos, LZ_MAX_DISTANCE) + 1):
+        length = 0
+        while length < max_len and data[pos + length - dist] == data[pos + length]:
+            length += 1
+        if length > best_len:
+            best_len = length
+            best_dist = dist
+            if length == max_len:
+                break
+    return (best_len, best_dist)
+
+def lz_packets(data, max_payload=SPM_PAYLOAD_SIZE):
+    """
+    Compress one page and split it into packet payloads.
+
+    Returns a list of `(offset, payload)` tuples, where `offset` is the
+    position in the page where the output of `payload` starts. Tokens are
+    never split across packets, so the bootloader can decode each packet on
+    its own.
+    """
+    data = bytearray(data)
+    packets = []
+    payload = bytearray()
+    start = 0
+    pos = 0
+    literals = bytearray()
+
+    def flush_packet():
+        packets.append((start, payload))
+
+    while pos <= len(data):
+        if pos < len(data):
+            length, dist = _longest_match(data, pos)
+        else:
+            length = 0
+
+        if length < LZ_MIN_MATCH and pos < len(data):
+            literals.append(data[pos])
+            pos += 1
+            continue
+
+        # emit the pending literals, filling the current packet first
+        out_pos = pos - len(literals)
+        while literals:
+            room = min(max_payload - len(payload) - 1, LZ_MAX_LITERAL)
+            if room < 1:
+                flush_packet()
+                payload = bytearray()
+                start = out_pos
+                continue
+            count = min(room, len(literals))
+            payload.append(count - 1)
+            payload += literals[:count]
+            literals = literals[count:]
+            out_pos += count
+
+        if pos == len(data):
+            break
+
+        if len(payload) + 2 > max_payload:
+            flush_packet()
+            payload = bytearray()
+            start = pos
+        payload.append(0x80 | (length - LZ_MIN_MATCH))
+        payload.append(dist - 1)
+        pos += length
+
+    if payload:
+        flush_packet()
+    return packets
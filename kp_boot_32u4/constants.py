@@ -10,6 +10,16 @@ USB_PID = 0xBB05
 
 EP_SIZE_VENDOR = 64
 
+EP_NUM_VENDOR_IN = 1
+EP_NUM_VENDOR_OUT = 2
+
+# Bulk interface of bootloaders built with USE_BULK_ENDPOINTS
+INTERFACE_BULK = 1
+EP_NUM_BULK_IN = 3
+EP_NUM_BULK_OUT = 4
+USB_CLASS_VENDOR = 0xff
+USB_DIR_IN = 0x80
+
 SPMEN_bm = (1<<0)
 PGERS_bm = (1<<1)
 PGWRT_bm = (1<<2)
@@ -20,7 +30,13 @@ RWWSB_bm = (1<<6)
 SPMIE_bm = (1<<7)
 
 SPM_HEADER_SIZE = 6
-SPM_PAYLOAD_SIZE = EP_SIZE_VENDOR - SPM_HEADER_SIZE
+
+# The last byte of every OUT packet holds a sequence tag that the bootloader
+# copies into its response.
+SEQ_TAG_POS = EP_SIZE_VENDOR - 1
+
+# Keep the payload a whole number of words so SPM chunks stay word aligned.
+SPM_PAYLOAD_SIZE = (EP_SIZE_VENDOR - SPM_HEADER_SIZE - 1) & ~1
 
 USB_CMD_VERSION = 0
 USB_CMD_INFO = 1
@@ -28,6 +44,67 @@ USB_CMD_ERASE = 2
 USB_CMD_SPM = 3
 USB_CMD_WRITE_EEPROM = 4
 USB_CMD_RESET = 5
+USB_CMD_WRITE_PAGE = 6
+USB_CMD_READ = 7
+USB_CMD_CRC = 8
+USB_CMD_SYNC = 9
+USB_CMD_WRITE_PAGE_LZ = 10
+USB_CMD_STATS = 11
+
+USB_STATUS_OK = 0
+USB_STATUS_UNKNOWN_CMD = 1
+USB_STATUS_BAD_ARG = 2
+
+USB_STATUS_NAMES = {
+    USB_STATUS_OK: "ok",
+    USB_STATUS_UNKNOWN_CMD: "unknown command",
+    USB_STATUS_BAD_ARG: "bad argument",
+}
+
+# Layout of the response report
+RESP_STATUS_POS = 3
+RESP_FEATURES_POS = 4
+RESP_DATA_POS = 6
+
+# Feature flags reported by bootloader versions >= 1
+FEATURE_STATUS = (1<<0)
+FEATURE_WRITE_PAGE = (1<<1)
+FEATURE_ERASE = (1<<2)
+FEATURE_SMART_PAGE = (1<<3)
+FEATURE_READ = (1<<4)
+FEATURE_CRC = (1<<5)
+FEATURE_PAGE_STAGING = (1<<6)
+FEATURE_EEPROM_UPDATE = (1<<7)
+FEATURE_EEPROM_QUEUE = (1<<8)
+FEATURE_WRITE_PAGE_LZ = (1<<9)
+FEATURE_CONTROL_PAGE = (1<<10)
+FEATURE_PERF_COUNTERS = (1<<11)
+
+# Timer1 tick of the counters returned by USB_CMD_STATS, in microseconds
+PERF_TICK_US = 4
+
+# Result of a USB_CMD_WRITE_PAGE, reported by FEATURE_SMART_PAGE devices
+PAGE_RESULT_NONE = 0
+PAGE_RESULT_SKIPPED = 1
+PAGE_RESULT_WRITTEN = 2
+PAGE_RESULT_ERASED = 3
+PAGE_RESULT_QUEUED = 4
+
+# Upper limit on the number of commands kept in flight. The actual window
+# adapts to the measured round trip time.
+PIPELINE_MAX_WINDOW = 8
+
+# Bulk IN packets are only read while the host waits for one, unlike HID
+# reports which the OS keeps reading. The bootloader can only hold this many
+# commands, two in the OUT banks and two responses in the IN banks, so a
+# bigger window would block the host's writes forever.
+BULK_MAX_IN_FLIGHT = 4
+
+# Seconds to wait for the application to enumerate after USB_CMD_RESET
+APP_ENUMERATION_TIMEOUT = 5.0
+
+# Seconds to wait for each device to answer USB_CMD_INFO in find_devices()
+PROBE_TIMEOUT = 1.0
 
 CHIP_ID_MASK = 0x3F
 
@@ -54,3 +131,25 @@ BOOT_SIZE_01 = (0b01 << BOOT_SIZE_bp)
 BOOT_SIZE_10 = (0b10 << BOOT_SIZE_bp)
 BOOT_SIZE_11 = (0b11 << BOOT_SIZE_bp)
 
+
+# Memory spaces for USB_CMD_READ
+READ_SPACE_FLASH = 0
+READ_SPACE_EEPROM = 1
+
+# Layout of the reports streamed back for USB_CMD_READ
+READ_DATA_POS = 4
+READ_MAX_LENGTH = 0xffff
+
+# Seconds to wait for the response to USB_CMD_ERASE, on top of the time it
+# takes to erase the pages. The datasheet gives at most 4.5ms per page.
+ERASE_TIMEOUT = 1.0
+PAGE_ERASE_TIME = 0.0045
+
+# Number of page CRCs returned by one USB_CMD_CRC
+CRC_MAX_PAGES = (SEQ_TAG_POS - RESP_DATA_POS) // 4
+
+# USB_CMD_WRITE_PAGE_LZ token limits, see compress.py
+LZ_MAX_LITERAL = 0x80
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = 0x7f + LZ_MIN_MATCH
+LZ_MAX_DISTANCE = 0x100
@@ -5,57 +5,232 @@
 
 from __future__ import absolute_import, division, print_function, unicode_literals
 
+import binascii
+import collections
 import easyhid
+import math
 import struct
+import sys
+import threading
+import time
 
 from intelhex import IntelHex
 from hexdump import hexdump
 
 from kp_boot_32u4.constants import *
+from kp_boot_32u4.compress import lz_packets
+from kp_boot_32u4.bulk import find_bulk_device
+from kp_boot_32u4.sim import SimTransport
 
 DEBUG_ENABLED = False
 
 class KpBoot32u4Error(Exception):
     pass
 
+def page_crc(data):
+    """CRC-32, as used by the bootloader's USB_CMD_CRC."""
+    return binascii.crc32(bytes(data)) & 0xffffffff
+
+class DeviceList(list):
+    """
+    The devices returned by `find_devices()`. Their handles are left open so
+    the next session can reuse them, `close()` closes the ones that won't be
+    used. `discovery_time` is the time in seconds it took to probe them all.
+    """
+    discovery_time = 0.0
+
+    def close(self):
+        for dev in self:
+            dev.disconnet()
+
 def find_devices(vid=USB_VID, pid=USB_PID, chip_name=None, min_version=None,
-                 path=None):
+                 path=None, prefer_bulk=sys.platform.startswith('linux'),
+                 serial_number=None, timeout=PROBE_TIMEOUT):
+    """
+    Find the bootloaders that are connected. With `prefer_bulk`, devices that
+    have a bulk interface are accessed through it with libusb instead of HID,
+    if pyusb is installed.
+
+    Devices that don't match `path` or `serial_number` are skipped before
+    they are opened, so other processes can use them at the same time. The
+    rest are probed in parallel, and any that don't answer within `timeout`
+    seconds are skipped.
+    """
+    start = time.time()
     hid_devices = easyhid.Enumeration().find(vid=vid, pid=pid)
-    result = []
+    candidates = []
     for hid_dev in hid_devices:
+        if path and hid_dev.path != path:
+            continue
+        if serial_number and getattr(hid_dev, "serial_number", None) != serial_number:
+            continue
+        dev = hid_dev
+        if prefer_bulk:
+            dev = find_bulk_device(hid_dev, vid, pid) or hid_dev
+        candidates.append((hid_dev, dev))
+
+    lock = threading.Lock()
+    probed = {}
+    abandoned = [False]
+
+    def probe(i, dev):
         try:
-            boot_dev = BootloaderDevice(hid_dev)
-        except:
+            boot_dev = BootloaderDevice(dev, keep_open=True, timeout=timeout)
+        except Exception:
+            boot_dev = None
+        with lock:
+            if abandoned[0]:
+                # answered after find_devices() gave up on it
+                if boot_dev:
+                    boot_dev.disconnet()
+                return
+            probed[i] = boot_dev
+
+    threads = []
+    for i, (hid_dev, dev) in enumerate(candidates):
+        thread = threading.Thread(target=probe, args=(i, dev))
+        thread.daemon = True
+        thread.start()
+        threads.append(thread)
+
+    # one deadline for all of them, they are probed at the same time
+    deadline = time.time() + timeout
+    for thread in threads:
+        thread.join(max(0, deadline - time.time()))
+
+    with lock:
+        abandoned[0] = True
+
+    result = DeviceList()
+    for i, (hid_dev, dev) in enumerate(candidates):
+        if i not in probed:
+            print(
+                "Warning: no response from a HID device within {}s: {}"
+                .format(timeout, hid_dev.description()),
+                file=sys.stderr
+            )
+            continue
+        boot_dev = probed[i]
+        if boot_dev is None:
             print(
                 "Warning: couldn't open a HID device check permissions and that"
                 " it is not already in use: {}".format(hid_dev.description()),
                 file=sys.stderr
             )
             continue
-        if chip_name and boot_dev.chip_name != chip_name:
-            continue
-        if min_version and boot_dev.version < min_version:
-            continue
-        if path and boot_dev.path != path:
+        if (chip_name and boot_dev.chip_name != chip_name) or \
+                (min_version and boot_dev.version < min_version):
+            boot_dev.disconnet()
             continue
         result.append(boot_dev)
+    result.discovery_time = time.time() - start
+    return result
+
+def open_device(path, vid=USB_VID, pid=USB_PID, serial_number=None,
+                prefer_bulk=sys.platform.startswith('linux'),
+                timeout=PROBE_TIMEOUT):
+    """
+    Open the bootloader at the HID `path` that a previous `find_devices()`
+    returned. Only that device is opened and probed, none of the others.
+    """
+    for hid_dev in easyhid.Enumeration().find(vid=vid, pid=pid):
+        if hid_dev.path != path:
+            continue
+        if serial_number and getattr(hid_dev, "serial_number", None) != serial_number:
+            raise KpBoot32u4Error(
+                "Device at '{}' has a different serial number".format(path)
+            )
+        dev = hid_dev
+        if prefer_bulk:
+            dev = find_bulk_device(hid_dev, vid, pid) or hid_dev
+        return BootloaderDevice(dev, timeout=timeout)
+    raise KpBoot32u4Error("Device not found: '{}'".format(path))
+
+def wait_for_device(vid, pid, since, timeout=APP_ENUMERATION_TIMEOUT):
+    """
+    Wait for a HID device with `vid` and `pid` to show up, e.g. the
+    application after `BootloaderDevice.reset_mcu()`. Returns the seconds
+    from `since` (a `time.time()` value) until it was found, or None if it
+    didn't show up within `timeout` seconds.
+    """
+    while time.time() - since < timeout:
+        if easyhid.Enumeration().find(vid=vid, pid=pid):
+            return time.time() - since
+        time.sleep(0.001)
+    return None
+
+def open_sim(lib_path, interface="hid"):
+    """
+    Returns a `BootloaderDevice` for the native emulator built by
+    `make -C sim`, see `sim.py`.
+    """
+    start = time.time()
+    result = DeviceList([BootloaderDevice(SimTransport(lib_path, interface))])
+    result.discovery_time = time.time() - start
     return result
 
 class BootloaderDevice(object):
-    def __init__(self, hid_dev):
-        self._hid_dev = hid_dev
+    def __init__(self, dev, keep_open=False, timeout=None):
+        """
+        Opens `dev` and reads the bootloader info, waiting at most `timeout`
+        seconds for the answer. With `keep_open`, the handle stays open and
+        is reused by the next `connect()`.
+        """
+        # an `easyhid.Device`, a `bulk.BulkTransport` or a `sim.SimTransport`
+        self._dev = dev
+        # The emulator has its own clock, so its results don't depend on the
+        # speed of the host.
+        self._clock = getattr(dev, "clock", time.time)
+        self._is_open = False
         self._mcu_has_been_reset = False
+        self._read_timeout = None
+
+        self._version = 0
+        self._features = 0
+
+        # commands that have been sent but whose response hasn't been read
+        # yet, as (sequence tag, send time, response callback) tuples
+        self._in_flight = collections.deque()
+        self._next_seq = 0
+        self._window = 1
+        self._max_window = getattr(dev, "max_in_flight", PIPELINE_MAX_WINDOW)
+        self._srtt = None
+        self._ack_interval = None
+        self._last_ack_time = None
 
-        with self._hid_dev:
+        # Send whole pages with control transfers instead of the interrupt
+        # endpoint, for FEATURE_CONTROL_PAGE devices accessed through HID.
+        self.use_control_transfers = False
+
+        self.reset_stats()
+
+        start = self._clock()
+        self.connect()
+        try:
+            self._read_timeout = timeout
             self._load_device_info()
+        except:
+            self.disconnet()
+            raise
+        finally:
+            self._read_timeout = None
+        # seconds it took to open the device and read its info
+        self.probe_time = self._clock() - start
+
+        if not keep_open:
+            self.disconnet()
 
     def connect(self):
-        self._hid_dev.open()
+        if self._is_open:
+            return
+        self._dev.open()
+        self._is_open = True
 
     def disconnet(self):
-        if self._mcu_has_been_reset:
+        if self._mcu_has_been_reset or not self._is_open:
             return
-        self._hid_dev.close()
+        self._dev.close()
+        self._is_open = False
 
     def __enter__(self):
         self.connect()
@@ -72,19 +247,210 @@ class BootloaderDevice(object):
         if DEBUG_ENABLED:
             print("Writing to device -> ")
             hexdump(bytes(data))
-        self._hid_dev.write(data)
-
-    def _read(self):
+        if self._stats_start is None:
+            self._stats_start = self._clock()
+        self._dev.write(data)
+        self._packets_sent += 1
+
+    def _read(self, timeout=None):
+        """
+        Read one report. `timeout` is in seconds, and defaults to the probe
+        timeout while opening, or to the transport's own timeout.
+        """
         if DEBUG_ENABLED:
             print("Read from device -> ")
-        data = self._hid_dev.read()
+        timeout = timeout or self._read_timeout
+        if timeout is None:
+            data = self._dev.read()
+        else:
+            data = self._dev.read(timeout=int(timeout * 1000))
+        if not data:
+            raise KpBoot32u4Error("Timed out waiting for a response")
         if DEBUG_ENABLED:
             hexdump(bytes(data))
         return data
 
+    def reset_stats(self):
+        self._packets_sent = 0
+        self._stats_start = None
+        self._page_results = collections.Counter()
+        self._eeprom_sent = 0
+        self._eeprom_written = 0
+        self._lz_page_bytes = 0
+        self._lz_sent_bytes = 0
+        self._lz_packets_saved = 0
+        # running statistics of the command round trip times
+        self._rtt_count = 0
+        self._rtt_mean = 0.0
+        self._rtt_m2 = 0.0
+        self._rtt_max = 0.0
+
+    def page_stats(self):
+        """
+        Returns a dict with the number of pages the bootloader skipped,
+        wrote without erasing and erased since the last `reset_stats()`. Only
+        counted for FEATURE_SMART_PAGE devices.
+        """
+        return {
+            "skipped": self._page_results[PAGE_RESULT_SKIPPED],
+            "written": self._page_results[PAGE_RESULT_WRITTEN],
+            "erased": self._page_results[PAGE_RESULT_ERASED],
+        }
+
+    def eeprom_stats(self):
+        """
+        Returns `(sent, written)`: the number of EEPROM bytes sent since the
+        last `reset_stats()`, and how many of them the bootloader actually had
+        to program. `written` is None if the bootloader doesn't report it.
+        """
+        if not self.has_feature(FEATURE_EEPROM_UPDATE):
+            return (self._eeprom_sent, None)
+        return (self._eeprom_sent, self._eeprom_written)
+
+    def compress_stats(self):
+        """
+        Returns a dict with the number of page bytes sent with
+        USB_CMD_WRITE_PAGE_LZ since the last `reset_stats()`, the number of
+        bytes they were compressed to, and how many packets that saved.
+        """
+        return {
+            "page_bytes": self._lz_page_bytes,
+            "sent_bytes": self._lz_sent_bytes,
+            "packets_saved": self._lz_packets_saved,
+        }
+
+    def latency_stats(self):
+        """
+        Returns `(mean, stddev, max)` of the time in seconds between sending
+        a command and reading its response, since the last `reset_stats()`.
+        This includes the time spent waiting behind the other commands in
+        flight. Returns None if nothing was measured.
+        """
+        if self._rtt_count == 0:
+            return None
+        stddev = math.sqrt(self._rtt_m2 / self._rtt_count)
+        return (self._rtt_mean, stddev, self._rtt_max)
+
+    def sim_errors(self):
+        """
+        Number of times the emulated bootloader used the hardware in a way
+        that would fail on a real chip. Only for the emulator.
+        """
+        return self._dev.errors()
+
+    def _record_rtt(self, rtt):
+        # Welford's online algorithm
+        self._rtt_count += 1
+        delta = rtt - self._rtt_mean
+        self._rtt_mean += delta / self._rtt_count
+        self._rtt_m2 += delta * (rtt - self._rtt_mean)
+        self._rtt_max = max(self._rtt_max, rtt)
+
+    def transfer_stats(self):
+        """
+        Returns `(packets, seconds)`: the number of OUT packets sent since the
+        last call to `reset_stats()` and the time elapsed since the first of
+        them was sent.
+        """
+        if self._stats_start is None:
+            return (0, 0.0)
+        return (self._packets_sent, self._clock() - self._stats_start)
+
+    def _submit(self, packet, on_response=None, timeout=None):
+        """
+        Send a command without waiting for its response.
+
+        Up to `self._window` commands are kept in flight. Responses are read
+        lazily and matched to their commands by the sequence tag. If given,
+        `on_response` is called with the response data once it arrives.
+        `timeout` is the time in seconds to wait for the response, for
+        commands that take longer than the transport's default.
+        """
+        while len(self._in_flight) >= self._window:
+            self._collect_response()
+
+        packet = bytearray(packet)
+        assert(len(packet) <= SEQ_TAG_POS)
+        packet += bytearray( [0xff] * (EP_SIZE_VENDOR - len(packet)) )
+
+        seq = self._next_seq
+        self._next_seq = (seq + 1) & 0xff
+        packet[SEQ_TAG_POS] = seq
+
+        self._in_flight.append((seq, self._clock(), on_response, timeout))
+        self._write(packet)
+
+    def _collect_response(self):
+        seq, send_time, on_response, timeout = self._in_flight.popleft()
+        data = self._read(timeout)
+        now = self._clock()
+
+        if data[SEQ_TAG_POS] != seq:
+            raise KpBoot32u4Error(
+                "Response out of sequence: expected tag {}, got {}"
+                .format(seq, data[SEQ_TAG_POS])
+            )
+
+        if self.has_feature(FEATURE_STATUS):
+            status = data[RESP_STATUS_POS]
+            if status != USB_STATUS_OK:
+                raise KpBoot32u4Error(
+                    "Command failed with status {} ({})".format(
+                        status, USB_STATUS_NAMES.get(status, "unknown")
+                    )
+                )
+            self._update_window(now - send_time, now)
+            self._record_rtt(now - send_time)
+
+        if on_response:
+            on_response(data)
+
+        return data
+
+    def _update_window(self, rtt, now):
+        # Keep smoothed estimates of the round trip time and the time
+        # between responses while the pipeline is busy. Their ratio is the
+        # number of commands the link can hold, so keep that many in flight
+        # plus one to absorb jitter.
+        if self._srtt is None:
+            self._srtt = rtt
+        else:
+            self._srtt += (rtt - self._srtt) / 8
+
+        if self._last_ack_time is not None:
+            interval = now - self._last_ack_time
+            if self._ack_interval is None:
+                self._ack_interval = interval
+            else:
+                self._ack_interval += (interval - self._ack_interval) / 8
+
+        # only measure the interval between back to back responses, time
+        # spent idle on the host shouldn't shrink the window
+        if self._in_flight:
+            self._last_ack_time = now
+        else:
+            self._last_ack_time = None
+
+        if self._ack_interval:
+            window = int(math.ceil(self._srtt / self._ack_interval)) + 1
+        else:
+            window = self._window + 1
+        self._window = max(1, min(self._max_window, window))
+
+    def _flush(self):
+        """Wait for the responses of all the commands in flight."""
+        data = None
+        while self._in_flight:
+            data = self._collect_response()
+        return data
+
+    def _command(self, packet, timeout=None):
+        """Send a command and wait for its response."""
+        self._submit(packet, timeout=timeout)
+        return self._flush()
+
     def _load_device_info(self):
-        self._write([USB_CMD_INFO])
-        data = self._read()
+        data = self._command([USB_CMD_INFO])
 
         response_cmd = data[0]
         if response_cmd != USB_CMD_INFO:
@@ -93,6 +459,8 @@ class BootloaderDevice(object):
             )
 
         self._version = data[1]
+        if self._version >= 1:
+            self._features = struct.unpack_from("<H", bytes(data), RESP_FEATURES_POS)[0]
 
         chip_id = data[2] & CHIP_ID_MASK
         bootsz = data[2] & BOOT_SIZE_MASK
@@ -120,9 +488,27 @@ class BootloaderDevice(object):
     def version(self):
         return self._version
 
+    @property
+    def features(self):
+        return self._features
+
+    def has_feature(self, feature):
+        return (self._features & feature) != 0
+
     @property
     def path(self):
-        return self._hid_dev.path
+        return self._dev.path
+
+    @property
+    def serial_number(self):
+        """The USB serial number, or None if the bootloader doesn't have one"""
+        return getattr(self._dev, "serial_number", None) or None
+
+    @property
+    def transport(self):
+        """Either "bulk" or "hid" depending on the interface in use, or "sim"
+        for the emulator"""
+        return getattr(self._dev, "transport", "hid")
 
     @property
     def page_size(self):
@@ -228,29 +614,170 @@ class BootloaderDevice(object):
         return result
 
     def erase_page(self, address):
-        self._write(self._flash_erase_packet(address))
-        self._read()
+        self._submit(self._flash_erase_packet(address))
 
     def write_flash_page(self, address, data):
         assert(address+self.page_size <= self.application_size)
         assert(len(data) <= self.page_size)
 
+        if self.has_feature(FEATURE_WRITE_PAGE):
+            self._write_page_streamed(address, data)
+            return
+
         self.erase_page(address)
 
         chunks = self._make_chunks(data, SPM_PAYLOAD_SIZE)
         for (i, chunk) in enumerate(chunks):
-            self._write(self._temporary_buffer_packet(
+            self._submit(self._temporary_buffer_packet(
                 address + i*SPM_PAYLOAD_SIZE,
                 chunk
             ))
-            self._read()
 
-        self._write(self._flash_write_packet(address))
-        self._read()
+        self._submit(self._flash_write_packet(address))
+
+    def _write_page_streamed(self, address, data):
+        # The bootloader only programs the page once it has received the
+        # whole page, so pad it out with erased flash values.
+        data = bytearray(data)
+        data += bytearray( [0xff] * (self.page_size - len(data)) )
+
+        on_response = None
+        if self.has_feature(FEATURE_SMART_PAGE):
+            on_response = self._count_page_result
+
+        if (self.use_control_transfers and self.transport == "hid" and
+                self.has_feature(FEATURE_CONTROL_PAGE)):
+            self._write_page_control(address, data, on_response)
+            return
+
+        chunks = self._make_chunks(data, SPM_PAYLOAD_SIZE)
+
+        if self.has_feature(FEATURE_WRITE_PAGE_LZ):
+            packets = lz_packets(data, SPM_PAYLOAD_SIZE)
+            # only worth it if the page fits in fewer packets
+            if len(packets) < len(chunks):
+                self._lz_page_bytes += len(data)
+                self._lz_sent_bytes += sum(len(p) for (_, p) in packets)
+                self._lz_packets_saved += len(chunks) - len(packets)
+                for (offset, payload) in packets:
+                    self._submit(self._spm_packet(
+                        USB_CMD_WRITE_PAGE_LZ,
+                        address,
+                        action = offset,
+                        data = payload
+                    ), on_response)
+                return
+
+        for (i, chunk) in enumerate(chunks):
+            self._submit(self._spm_packet(
+                USB_CMD_WRITE_PAGE,
+                address + i*SPM_PAYLOAD_SIZE,
+                action = 0,
+                data = chunk
+            ), on_response)
+
+    def _write_page_control(self, address, data, on_response):
+        # Control transfers aren't ordered with the interrupt endpoints, so
+        # everything sent before has to be finished first.
+        self._flush()
+
+        # same header as USB_CMD_WRITE_PAGE, followed by the whole page
+        report = bytearray(struct.pack("<BHBBB", USB_CMD_WRITE_PAGE, address, 0, 0, 0))
+        report += data
+
+        if self._stats_start is None:
+            self._stats_start = self._clock()
+        self._dev.send_feature_report(report)
+        self._packets_sent += 1
+
+        # easyhid strips the report ID that hidapi puts in front of the data
+        response = self._dev.get_feature_report(
+            size = EP_SIZE_VENDOR,
+            report_id = 0
+        )
+        if len(response) < EP_SIZE_VENDOR:
+            raise KpBoot32u4Error(
+                "Page write response too short: got {} bytes, expected {}"
+                .format(len(response), EP_SIZE_VENDOR)
+            )
+        status = response[RESP_STATUS_POS]
+        if status != USB_STATUS_OK:
+            raise KpBoot32u4Error(
+                "Page write failed with status {} ({})".format(
+                    status, USB_STATUS_NAMES.get(status, "unknown")
+                )
+            )
+        if on_response:
+            on_response(response)
+
+    def _count_page_result(self, data):
+        result = data[RESP_DATA_POS]
+        if result in (PAGE_RESULT_SKIPPED, PAGE_RESULT_WRITTEN, PAGE_RESULT_ERASED):
+            self._page_results[result] += 1
+
+    def sync(self):
+        """
+        Wait for the bootloader to finish all writes it is doing in the
+        background. The page results it reports are added to `page_stats()`
+        and the EEPROM bytes it programmed to `eeprom_stats()`.
+        """
+        staging = self.has_feature(FEATURE_PAGE_STAGING)
+        eeprom_queue = self.has_feature(FEATURE_EEPROM_QUEUE)
+        if not (staging or eeprom_queue):
+            self._flush()
+            return
+
+        data = self._command([USB_CMD_SYNC])
+        skipped, written, erased, eeprom_written = struct.unpack_from(
+            "<HHHH", bytes(data), RESP_DATA_POS
+        )
+        if staging:
+            self._page_results[PAGE_RESULT_SKIPPED] += skipped
+            self._page_results[PAGE_RESULT_WRITTEN] += written
+            self._page_results[PAGE_RESULT_ERASED] += erased
+        if eeprom_queue:
+            self._eeprom_written += eeprom_written
+
+    def device_stats(self):
+        """
+        Read and clear the performance counters of a FEATURE_PERF_COUNTERS
+        bootloader. Returns a dict with the time since they were last cleared,
+        the time spent idle and waiting for flash and EEPROM in seconds, and
+        the number of commands, NAKed polls and watchdog resets. Returns None
+        if the bootloader doesn't have the counters.
+        """
+        if not self.has_feature(FEATURE_PERF_COUNTERS):
+            return None
+        data = self._command([USB_CMD_STATS])
+        values = struct.unpack_from("<8I", bytes(data), RESP_DATA_POS)
+        names = (
+            "elapsed", "usb_idle", "spm_wait", "eeprom_wait",
+            "packets", "nak_in", "nak_out", "wdt_resets",
+        )
+        stats = dict(zip(names, values))
+        for name in names[:4]:
+            stats[name] *= PERF_TICK_US / 1e6
+        return stats
+
+    def erase_flash_range(self, address, page_count):
+        """Erase `page_count` pages starting at `address` on the device."""
+        assert(address % self.page_size == 0)
+        # the response only comes once every page has been erased
+        self._command(self._spm_packet(
+            USB_CMD_ERASE,
+            address,
+            action = 0,
+            data = struct.pack("<H", page_count)
+        ), timeout = ERASE_TIMEOUT + page_count * PAGE_ERASE_TIME)
 
     def erase_application_flash(self):
+        if self.has_feature(FEATURE_ERASE):
+            self.erase_flash_range(0, self.application_size // self.page_size)
+            return
+
         for pg_num in range(self.application_size // self.page_size):
             self.erase_page(pg_num * self.page_size)
+        self._flush()
 
     # def write_flash(self, start_address, data):
     #     assert(start_address + len(data) <= self.application_size)
@@ -258,22 +785,92 @@ class BootloaderDevice(object):
     def write_eeprom(self, start_address, data):
         assert(start_address + len(data) <= self.eeprom_size)
 
-
         chunks = self._make_chunks(data, SPM_PAYLOAD_SIZE)
+
+        # A bootloader with the EEPROM queue NAKs the packets while the queue
+        # is full, so they can be sent the same way. The bytes programmed are
+        # counted by sync() instead.
+        def count_written(data):
+            self._eeprom_written += data[RESP_DATA_POS]
+
         for (i, chunk) in enumerate(chunks):
-            self._write(self._spm_packet(
+            self._submit(self._spm_packet(
                 USB_CMD_WRITE_EEPROM,
                 start_address + i*SPM_PAYLOAD_SIZE,
                 action = 0,
                 data = chunk
-            ))
-            self._read()
+            ), count_written)
+            self._eeprom_sent += len(chunk)
+        self.sync()
 
     def reset_mcu(self):
+        # the reset command is never answered, so make sure everything sent
+        # before it has completed
+        self._flush()
+        self.reset_time = time.time()
         self._write([USB_CMD_RESET])
         self._mcu_has_been_reset = True
 
 
+    def _read_memory(self, space, start_address, length):
+        if not self.has_feature(FEATURE_READ):
+            raise KpBoot32u4Error("Bootloader doesn't support reading memory")
+
+        result = bytearray()
+        while length:
+            count = min(length, READ_MAX_LENGTH)
+            result += self._read_stream(space, start_address + len(result), count)
+            length -= count
+        return result
+
+    def _read_stream(self, space, start_address, length):
+        self._command(self._spm_packet(
+            USB_CMD_READ,
+            start_address,
+            action = space,
+            data = struct.pack("<H", length)
+        ))
+
+        # the bootloader now streams back the data without further requests
+        result = bytearray()
+        while len(result) < length:
+            data = self._read()
+            address = (start_address + len(result)) & 0xffff
+            if data[0] != USB_CMD_READ \
+                    or struct.unpack_from("<H", bytes(data), 1)[0] != address:
+                raise KpBoot32u4Error(
+                    "Unexpected report while reading address {}".format(address)
+                )
+            count = data[3]
+            result += bytearray(data[READ_DATA_POS:READ_DATA_POS+count])
+        return result
+
+    def read_flash(self, start_address=0, length=None):
+        """Read flash, by default the whole application section."""
+        if length == None:
+            length = self.application_size - start_address
+        assert(start_address + length <= self.flash_size)
+        return self._read_memory(READ_SPACE_FLASH, start_address, length)
+
+    def read_eeprom(self, start_address=0, length=None):
+        """Read EEPROM, by default all of it."""
+        if length == None:
+            length = self.eeprom_size - start_address
+        assert(start_address + length <= self.eeprom_size)
+        return self._read_memory(READ_SPACE_EEPROM, start_address, length)
+
+    def dump_flash_hex(self, hex_file):
+        """Save the application section to an Intel HEX file."""
+        dump_hex = IntelHex()
+        dump_hex.frombytes(self.read_flash())
+        dump_hex.write_hex_file(hex_file)
+
+    def dump_eeprom_hex(self, hex_file):
+        """Save the EEPROM to an Intel HEX file."""
+        dump_hex = IntelHex()
+        dump_hex.frombytes(self.read_eeprom())
+        dump_hex.write_hex_file(hex_file)
+
     def write_flash_hex(self, flash_file):
         flash_hex = IntelHex()
         flash_hex.fromfile(flash_file, "hex")
@@ -301,13 +898,58 @@ class BootloaderDevice(object):
 
         # flash is only page accessible, so look at each page in the hex file
         # and see if it needs to be written
+        pages = []
         for start in range(0, self.application_size, self.page_size):
             end = start+self.page_size
             if not is_page_used(start, end):
                 continue
-            # Get the data for the current page and write it
+            # Get the data for the current page
             data = bytearray(flash_hex.tobinstr(start, end-1))
+            pages.append((start, data))
+
+        # Only send the pages whose contents differ from what is on the
+        # device already.
+        if self.has_feature(FEATURE_CRC) and pages:
+            first_page = pages[0][0]
+            page_count = (pages[-1][0] - first_page) // self.page_size + 1
+            crcs = self.flash_page_crcs(first_page, page_count)
+
+            changed_pages = []
+            for (start, data) in pages:
+                device_crc = crcs[(start - first_page) // self.page_size]
+                if device_crc == page_crc(data):
+                    self._page_results[PAGE_RESULT_SKIPPED] += 1
+                else:
+                    changed_pages.append((start, data))
+            pages = changed_pages
+
+        for (start, data) in pages:
             self.write_flash_page(start, data)
+        self.sync()
+
+    def flash_page_crcs(self, start_address, page_count):
+        """
+        Returns the CRC-32 of each of the `page_count` flash pages
+        starting at `start_address`, as computed by the bootloader.
+        """
+        crcs = [None] * page_count
+
+        def store_crcs(first, count):
+            def on_response(data):
+                crcs[first:first+count] = struct.unpack_from(
+                    "<{}I".format(count), bytes(data), RESP_DATA_POS
+                )
+            return on_response
+
+        for first in range(0, page_count, CRC_MAX_PAGES):
+            count = min(CRC_MAX_PAGES, page_count - first)
+            self._submit(self._spm_packet(
+                USB_CMD_CRC,
+                start_address + first * self.page_size,
+                action = count,
+            ), store_crcs(first, count))
+        self._flush()
+        return crcs
 
     def write_eeprom_hex(self, eep_file):
         eep_hex = IntelHex()
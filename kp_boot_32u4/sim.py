@@ -0,0 +1,142 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# Copyright 2018 jem@seethis.link
+# Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+"""
+Transport for the native emulator of the bootloader.
+
+`make -C sim BOARD=...` builds the bootloader's C code for the host as a
+shared library, with the AVR registers, flash and EEPROM emulated, and USB
+packets moved on 1ms frames. It is loaded here with ctypes, so the rest of
+the package can flash it like a real device. All times are measured in
+emulated time, so the results don't depend on the speed of the host.
+
+The library keeps its state in globals, so each process can only run one
+emulated device.
+"""
+
+from __future__ import absolute_import, division, print_function, unicode_literals
+
+import ctypes
+import os
+
+from kp_boot_32u4.constants import *
+
+SIM_OK = 0
+SIM_ERR_TIMEOUT = -1
+SIM_ERR_DETACHED = -2
+SIM_ERR_ARG = -3
+
+SIM_SPACE_FLASH = 0
+SIM_SPACE_EEPROM = 1
+
+# milliseconds to wait for a single packet
+SIM_TIMEOUT = 1000
+
+class SimError(IOError):
+    pass
+
+def _load_library(lib_path):
+    lib = ctypes.CDLL(os.path.abspath(lib_path))
+    lib.sim_power_on.restype = ctypes.c_int
+    lib.sim_write.argtypes = [ctypes.c_uint8, ctypes.c_char_p, ctypes.c_uint8]
+    lib.sim_write.restype = ctypes.c_int
+    lib.sim_read.argtypes = [ctypes.c_uint8, ctypes.c_char_p, ctypes.c_uint32]
+    lib.sim_read.restype = ctypes.c_int
+    lib.sim_idle.argtypes = [ctypes.c_uint32]
+    lib.sim_idle.restype = ctypes.c_int
+    lib.sim_time_us.restype = ctypes.c_uint64
+    for fn in (lib.sim_load, lib.sim_dump):
+        fn.argtypes = [
+            ctypes.c_uint8, ctypes.c_uint16, ctypes.c_char_p, ctypes.c_uint16
+        ]
+        fn.restype = ctypes.c_int
+    lib.sim_errors.restype = ctypes.c_uint32
+    return lib
+
+class SimTransport(object):
+    """
+    Talks to the emulated bootloader with the same methods that
+    `BootloaderDevice` uses on an `easyhid.Device`. With `interface="bulk"`
+    the bulk endpoints are used, if the emulated build has them.
+    """
+    transport = "sim"
+    max_in_flight = PIPELINE_MAX_WINDOW
+
+    def __init__(self, lib_path, interface="hid"):
+        self._lib = _load_library(lib_path)
+        self.path = lib_path
+        self.serial_number = None
+        self.interface = interface
+        if interface == "bulk":
+            self._ep_in, self._ep_out = EP_NUM_BULK_IN, EP_NUM_BULK_OUT
+            self.max_in_flight = BULK_MAX_IN_FLIGHT
+        else:
+            self._ep_in, self._ep_out = EP_NUM_VENDOR_IN, EP_NUM_VENDOR_OUT
+        self._check(self._lib.sim_power_on(), "power on")
+
+    def _check(self, result, what):
+        if result == SIM_ERR_TIMEOUT:
+            raise SimError("emulator: {} timed out".format(what))
+        if result == SIM_ERR_DETACHED:
+            raise SimError("emulator: {} failed, device detached".format(what))
+        if result < 0:
+            raise SimError("emulator: {} failed ({})".format(what, result))
+        return result
+
+    def open(self):
+        pass
+
+    def close(self):
+        pass
+
+    def __enter__(self):
+        self.open()
+        return self
+
+    def __exit__(self, err_type, err_value, traceback):
+        self.close()
+
+    def write(self, data):
+        data = bytes(bytearray(data))
+        self._check(self._lib.sim_write(self._ep_out, data, len(data)), "write")
+
+    def read(self, timeout=None):
+        """Read one packet, `timeout` is in milliseconds of emulated time"""
+        buf = ctypes.create_string_buffer(EP_SIZE_VENDOR)
+        result = self._lib.sim_read(self._ep_in, buf, timeout or SIM_TIMEOUT)
+        if result == SIM_ERR_TIMEOUT:
+            return bytearray()
+        length = self._check(result, "read")
+        return bytearray(buf.raw[:length])
+
+    def sleep(self, seconds):
+        """Let the emulated device run on its own for a while"""
+        self._check(self._lib.sim_idle(int(seconds * 1e6)), "sleep")
+
+    def clock(self):
+        """Seconds of emulated time since power on"""
+        return self._lib.sim_time_us() / 1e6
+
+    def load(self, space, address, data):
+        """Preload emulated flash or EEPROM, e.g. with an older image"""
+        data = bytes(bytearray(data))
+        self._check(
+            self._lib.sim_load(space, address, data, len(data)), "load"
+        )
+
+    def dump(self, space, address, length):
+        buf = ctypes.create_string_buffer(length)
+        self._check(self._lib.sim_dump(space, address, buf, length), "dump")
+        return bytearray(buf.raw)
+
+    def errors(self):
+        """
+        Number of times the firmware used the hardware in a way that would
+        fail on a real chip, the details are printed to stderr
+        """
+        return self._lib.sim_errors()
+
+    def description(self):
+        return "emulator {} ({} interface)".format(self.path, self.interface)
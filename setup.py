@@ -27,6 +27,10 @@ setup(
     license = 'MIT',
     packages = [app_name],
     install_requires = ['hexdump', 'intelhex', 'easyhid'],
+    extras_require = {
+        # faster transfers through the bulk interface on Linux
+        'bulk': ['pyusb>=1.1'],
+    },
     keywords = ['usb', 'hid', 'avr', 'atmega32u4', 'bootloader'],
     scripts = ['kp_boot_32u4-cli'],
     zip_safe = False
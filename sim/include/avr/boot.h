@@ -0,0 +1,23 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Stand-in for avr-libc's <avr/boot.h>, see sim/sim.h
+
+#pragma once
+
+#include <avr/io.h>
+
+#define boot_spm_busy() (SPMCSR & (1<<SPMEN))
+#define boot_spm_busy_wait() do {} while (boot_spm_busy())
+#define boot_rww_busy() (SPMCSR & (1<<RWWSB))
+
+#define boot_page_fill(address, data) \
+    sim_spm((address), (1<<SPMEN), (data))
+#define boot_page_erase(address) \
+    sim_spm((address), (1<<PGERS) | (1<<SPMEN), 0)
+#define boot_page_write(address) \
+    sim_spm((address), (1<<PGWRT) | (1<<SPMEN), 0)
+#define boot_rww_enable() \
+    sim_spm(0, (1<<RWWSRE) | (1<<SPMEN), 0)
+
+#define boot_signature_byte_get(address) sim_signature_byte(address)
@@ -0,0 +1,25 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Stand-in for avr-libc's <avr/eeprom.h>, see sim/sim.h
+
+#pragma once
+
+#include <avr/io.h>
+
+#define eeprom_is_ready() (!(EECR & (1<<EEPE)))
+#define eeprom_busy_wait() do {} while (!eeprom_is_ready())
+
+#define eeprom_read_byte(address) \
+    sim_eeprom_read_byte((uint16_t)(uintptr_t)(address))
+
+// Same as avr-libc: wait for the previous write, then erase and write the
+// byte through the emulated registers, so it takes as long as on the chip.
+static inline void eeprom_write_byte(uint8_t *address, uint8_t value) {
+    eeprom_busy_wait();
+    EEAR = (uint16_t)(uintptr_t)address;
+    EEDR = value;
+    EECR = 0;
+    EECR |= (1<<EEMPE);
+    EECR |= (1<<EEPE);
+}
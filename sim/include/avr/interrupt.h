@@ -0,0 +1,17 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Stand-in for avr-libc's <avr/interrupt.h>, see sim/sim.h. The emulator
+// never runs the ISRs, the bootloader's ISRs only wake up the CPU.
+
+#pragma once
+
+#include <avr/io.h>
+
+#define cli()
+#define sei()
+
+#define USB_GEN_vect sim_usb_gen_vect
+#define USB_COM_vect sim_usb_com_vect
+
+#define ISR(vector) void vector(void); void vector(void)
@@ -0,0 +1,157 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Stand-in for avr-libc's <avr/io.h> when the bootloader is built for the
+// native emulator. Only the registers and bits the bootloader uses are
+// defined, and every register access is routed through the emulator.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "sim.h"
+
+#if !defined(__AVR_ATmega32U4__)
+#  error "The emulator only models the ATmega32u4"
+#endif
+
+#define _BV(bit) (1 << (bit))
+
+#define SPM_PAGESIZE 128
+#define FLASHEND 0x7FFF
+#define E2END 0x3FF
+
+#define SIM_REG(name) (*sim_reg8(SIM_REG_##name))
+
+// USB device and endpoint registers
+#define UENUM   SIM_REG(UENUM)
+#define UEINTX  SIM_REG(UEINTX)
+#define UEBCLX  SIM_REG(UEBCLX)
+#define UECONX  SIM_REG(UECONX)
+#define UECFG0X SIM_REG(UECFG0X)
+#define UECFG1X SIM_REG(UECFG1X)
+#define UEIENX  SIM_REG(UEIENX)
+#define UERST   SIM_REG(UERST)
+#define UEINT   SIM_REG(UEINT)
+#define UDINT   SIM_REG(UDINT)
+#define UDIEN   SIM_REG(UDIEN)
+#define UDCON   SIM_REG(UDCON)
+#define UDADDR  SIM_REG(UDADDR)
+#define UHWCON  SIM_REG(UHWCON)
+#define USBCON  SIM_REG(USBCON)
+#define PLLCSR  SIM_REG(PLLCSR)
+#define UEDATX  (*sim_uedatx())
+
+// EEPROM, SPM and system control
+#define EEAR    (*sim_reg_eear())
+#define EECR    SIM_REG(EECR)
+#define EEDR    SIM_REG(EEDR)
+#define SPMCSR  SIM_REG(SPMCSR)
+#define MCUCR   SIM_REG(MCUCR)
+#define MCUSR   SIM_REG(MCUSR)
+#define CLKPR   SIM_REG(CLKPR)
+#define WDTCSR  SIM_REG(WDTCSR)
+
+// Timer1, only the free running mode is modeled
+#define TCCR1A  SIM_REG(TCCR1A)
+#define TCCR1B  SIM_REG(TCCR1B)
+#define TCNT1   (*sim_reg_tcnt1())
+
+// UEINTX
+#define FIFOCON  7
+#define NAKINI   6
+#define RWAL     5
+#define NAKOUTI  4
+#define RXSTPI   3
+#define RXOUTI   2
+#define STALLEDI 1
+#define TXINI    0
+
+// UEIENX
+#define FLERRE   7
+#define NAKINE   6
+#define NAKOUTE  4
+#define RXSTPE   3
+#define RXOUTE   2
+#define STALLEDE 1
+#define TXINE    0
+
+// UECONX
+#define STALLRQ  5
+#define STALLRQC 4
+#define RSTDT    3
+#define EPEN     0
+
+// UDINT / UDIEN
+#define UPRSMI   6
+#define EORSMI   5
+#define WAKEUPI  4
+#define EORSTI   3
+#define SOFI     2
+#define SUSPI    0
+#define UPRSME   6
+#define EORSME   5
+#define WAKEUPE  4
+#define EORSTE   3
+#define SOFE     2
+#define SUSPE    0
+
+// UDCON / UDADDR
+#define LSM      2
+#define RMWKUP   1
+#define DETACH   0
+#define ADDEN    7
+
+// USBCON / PLLCSR
+#define USBE     7
+#define FRZCLK   5
+#define OTGPADE  4
+#define VBUSTE   0
+#define PINDIV   4
+#define PLLE     1
+#define PLOCK    0
+
+// EECR
+#define EEPM1    5
+#define EEPM0    4
+#define EERIE    3
+#define EEMPE    2
+#define EEPE     1
+#define EERE     0
+
+// SPMCSR
+#define SPMIE    7
+#define RWWSB    6
+#define SIGRD    5
+#define RWWSRE   4
+#define BLBSET   3
+#define PGWRT    2
+#define PGERS    1
+#define SPMEN    0
+
+// MCUCR / MCUSR
+#define JTD      7
+#define PUD      4
+#define IVSEL    1
+#define IVCE     0
+#define JTRF     4
+#define WDRF     3
+#define BORF     2
+#define EXTRF    1
+#define PORF     0
+
+// CLKPR / WDTCSR
+#define CLKPCE   7
+#define WDIF     7
+#define WDIE     6
+#define WDP3     5
+#define WDCE     4
+#define WDE      3
+#define WDP2     2
+#define WDP1     1
+#define WDP0     0
+
+// TCCR1B
+#define CS12     2
+#define CS11     1
+#define CS10     0
@@ -0,0 +1,18 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Stand-in for avr-libc's <avr/pgmspace.h>, see sim/sim.h. Data marked
+// PROGMEM stays in host memory, only the emulated flash is read with
+// pgm_read_*().
+
+#pragma once
+
+#include <avr/io.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(address) sim_pgm_read_byte((uint16_t)(uintptr_t)(address))
+#define pgm_read_word(address) ( \
+    pgm_read_byte(address) | \
+    (pgm_read_byte((uint16_t)(uintptr_t)(address) + 1) << 8) \
+)
@@ -0,0 +1,15 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Stand-in for avr-libc's <avr/sleep.h>, see sim/sim.h
+
+#pragma once
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE 0
+
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() sim_sleep()
@@ -0,0 +1,22 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Stand-in for avr-libc's <avr/wdt.h>, see sim/sim.h
+
+#pragma once
+
+#include <avr/io.h>
+
+#define WDTO_15MS   0
+#define WDTO_30MS   1
+#define WDTO_60MS   2
+#define WDTO_120MS  3
+#define WDTO_250MS  4
+#define WDTO_500MS  5
+#define WDTO_1S     6
+#define WDTO_2S     7
+#define WDTO_4S     8
+#define WDTO_8S     9
+
+#define wdt_reset() sim_wdt_reset()
+#define wdt_enable(timeout) sim_wdt_enable(timeout)
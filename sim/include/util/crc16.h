@@ -0,0 +1,21 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Stand-in for avr-libc's <util/crc16.h>, using the C equivalent given in
+// its documentation.
+
+#pragma once
+
+#include <stdint.h>
+
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data) {
+    crc = crc ^ ((uint16_t)data << 8);
+    for (uint8_t i = 0; i < 8; i++) {
+        if (crc & 0x8000) {
+            crc = (crc << 1) ^ 0x1021;
+        } else {
+            crc <<= 1;
+        }
+    }
+    return crc;
+}
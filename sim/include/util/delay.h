@@ -0,0 +1,11 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Stand-in for avr-libc's <util/delay.h>, see sim/sim.h
+
+#pragma once
+
+#include "sim.h"
+
+#define _delay_us(us) sim_delay_us(us)
+#define _delay_ms(ms) sim_delay_us((ms) * 1000UL)
@@ -0,0 +1,796 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Native emulator for the bootloader, see sim.h.
+//
+// Timing model:
+//
+// * Every register access costs SIM_ACCESS_CYCLES at 16MHz. The code in
+//   between is free, so the emulated CPU is a bit faster than the real one.
+// * Page erase and page write take 4ms, EEPROM erase+write takes 3.4ms and
+//   erase-only or write-only take 1.8ms, like the datasheet values.
+// * The host is infinitely fast, it only waits for the bus. Interrupt
+//   endpoints move at most one packet per 1ms frame, and the host polls the
+//   interrupt IN endpoints every frame like the HID driver does. Bulk
+//   endpoints move one packet per SIM_BULK_SLOTS slot in a frame, and the
+//   bulk IN endpoint is only read while the host is waiting for it.
+//
+// The firmware runs as a coroutine. The host side calls resume it until the
+// packet they are waiting for has moved, then the firmware is suspended in
+// the middle of whatever register access it was doing.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include <avr/io.h>
+#include <avr/wdt.h>
+
+#include "sim.h"
+#include "usb.h"
+#include "usb/descriptors.h"
+
+#define SIM_ACCESS_CYCLES 4
+#define SIM_US(us) ((uint64_t)(us) * (SIM_F_CPU / 1000000))
+
+#define SIM_FRAME_CYCLES SIM_US(1000)
+// 64 byte bulk packets that fit in a full speed frame
+#define SIM_BULK_SLOTS 19
+
+#define SIM_FLASH_ERASE_CYCLES SIM_US(4000)
+#define SIM_FLASH_WRITE_CYCLES SIM_US(4000)
+#define SIM_EEPROM_ATOMIC_CYCLES SIM_US(3400)
+#define SIM_EEPROM_SPLIT_CYCLES SIM_US(1800)
+// EEPE has to be set within 4 cycles of EEMPE
+#define SIM_EEMPE_CYCLES (2*SIM_ACCESS_CYCLES)
+
+// The last 4kb of flash can't be read while the rest is being programmed
+#define SIM_NRWW_START 0x7000
+
+#define SIM_EP_COUNT 7
+#define SIM_EP_SIZE 64
+// reports buffered by the host's HID driver
+#define SIM_HOST_QUEUE_SIZE 64
+
+#define SIM_STACK_SIZE (256 * 1024)
+#define SIM_HOST_TIMEOUT_MS 1000
+#define SIM_MAX_ERROR_MESSAGES 16
+
+#define EP_TYPE_MASK 0xC0
+#define EP_TYPE_BULK 0x80
+#define EP_TYPE_INTERRUPT 0xC0
+#define EP_DIR_IN 0x01
+#define EP_BANKS_MASK 0x0C
+
+typedef struct {
+    uint8_t data[SIM_EP_SIZE];
+    uint8_t length;
+} sim_packet_t;
+
+typedef struct {
+    uint8_t ueintx;
+    uint8_t ueconx;
+    uint8_t uecfg0x;
+    uint8_t uecfg1x;
+    uint8_t ueienx;
+    uint8_t uebclx;
+
+    // banks owned by the device, `head` is the oldest one with data
+    sim_packet_t banks[2];
+    uint8_t head;
+    uint8_t count;
+    // FIFO position in the bank the firmware is using
+    uint8_t pos;
+    // NAKINI and NAKOUTI, set when the bus finds the endpoint not ready
+    uint8_t nak_flags;
+
+    // host side: a write waiting to be sent and the packets received
+    bool out_pending;
+    sim_packet_t out_packet;
+    bool read_pending;
+    sim_packet_t in_queue[SIM_HOST_QUEUE_SIZE];
+    uint8_t in_head;
+    uint8_t in_count;
+} sim_ep_t;
+
+static uint64_t s_cycles;
+static uint64_t s_next_frame;
+static uint64_t s_next_bulk_slot;
+static uint8_t s_bulk_slot;
+
+static uint8_t s_regs[SIM_REG_COUNT];
+static uint16_t s_eear;
+static uint16_t s_tcnt1;
+static uint8_t s_dummy;
+static sim_ep_t s_ep[SIM_EP_COUNT];
+
+// the register returned by the last access, its side effects are applied on
+// the next one
+static struct {
+    volatile uint8_t *ptr;
+    uint8_t reg;
+    uint8_t ep;
+    uint8_t value;
+} s_pending;
+
+static uint8_t s_flash[FLASHEND+1];
+static uint8_t s_eeprom[E2END+1];
+static uint16_t s_page_buf[SPM_PAGESIZE/2];
+static bool s_mem_init;
+static uint64_t s_spm_busy_until;
+static bool s_rww_busy;
+static uint64_t s_eeprom_busy_until;
+static uint64_t s_eempe_cycle;
+
+static bool s_attached;
+static bool s_bus_reset;
+static bool s_powered;
+static bool s_reset;
+static uint64_t s_wdt_timeout;
+static uint64_t s_wdt_last;
+
+static uint32_t s_errors;
+
+static ucontext_t s_host_ctx;
+static ucontext_t s_fw_ctx;
+static bool (*s_wait)(void);
+static uint8_t s_wait_ep;
+static uint64_t s_deadline;
+
+static void sim_error(const char *msg) {
+    if (s_errors++ < SIM_MAX_ERROR_MESSAGES) {
+        fprintf(
+            stderr, "sim: %.3fms: %s\n",
+            (double)s_cycles / SIM_US(1000), msg
+        );
+    }
+}
+
+/**************************************************************************
+ *
+ *  Memories
+ *
+ **************************************************************************/
+
+static void sim_mem_init(void) {
+    if (s_mem_init) {
+        return;
+    }
+    memset(s_flash, 0xff, sizeof(s_flash));
+    memset(s_eeprom, 0xff, sizeof(s_eeprom));
+    memset(s_page_buf, 0xff, sizeof(s_page_buf));
+    s_mem_init = true;
+}
+
+static bool sim_spm_busy(void) {
+    return s_cycles < s_spm_busy_until;
+}
+
+static bool sim_eeprom_busy(void) {
+    return s_cycles < s_eeprom_busy_until;
+}
+
+void sim_spm(uint16_t address, uint8_t spmcsr, uint16_t value) {
+    uint8_t *const page = s_flash + (address & ~(SPM_PAGESIZE-1));
+
+    sim_cycles(SIM_ACCESS_CYCLES);
+    if (sim_spm_busy()) {
+        sim_error("SPM started while the last one is still running");
+        return;
+    }
+    if (sim_eeprom_busy()) {
+        sim_error("SPM started during an EEPROM write");
+        return;
+    }
+
+    switch (spmcsr & ~(1<<SPMEN)) {
+        case 0: {
+            s_page_buf[(address & (SPM_PAGESIZE-1)) / 2] = value;
+        } break;
+
+        case (1<<PGERS): {
+            memset(page, 0xff, SPM_PAGESIZE);
+            s_spm_busy_until = s_cycles + SIM_FLASH_ERASE_CYCLES;
+            s_rww_busy = s_rww_busy || address < SIM_NRWW_START;
+        } break;
+
+        case (1<<PGWRT): {
+            // programming can only clear bits
+            for (uint8_t i = 0; i < SPM_PAGESIZE/2; ++i) {
+                page[2*i + 0] &= s_page_buf[i] & 0xff;
+                page[2*i + 1] &= s_page_buf[i] >> 8;
+            }
+            memset(s_page_buf, 0xff, sizeof(s_page_buf));
+            s_spm_busy_until = s_cycles + SIM_FLASH_WRITE_CYCLES;
+            s_rww_busy = s_rww_busy || address < SIM_NRWW_START;
+        } break;
+
+        case (1<<RWWSRE): {
+            memset(s_page_buf, 0xff, sizeof(s_page_buf));
+            s_rww_busy = false;
+        } break;
+
+        default: {
+            // lock bits and signature reads aren't modeled
+        } break;
+    }
+}
+
+/// Spin until the current SPM operation is done, like `call_spm` does
+void sim_spm_wait(void) {
+    while (sim_spm_busy()) {
+        sim_cycles(SIM_ACCESS_CYCLES);
+    }
+}
+
+uint8_t sim_pgm_read_byte(uint16_t address) {
+    sim_cycles(SIM_ACCESS_CYCLES);
+    if (address < SIM_NRWW_START && (s_rww_busy || sim_spm_busy())) {
+        sim_error("RWW section read while it is busy");
+        return 0xff;
+    }
+    return s_flash[address & FLASHEND];
+}
+
+uint8_t sim_eeprom_read_byte(uint16_t address) {
+    // avr-libc waits for the last write to finish
+    while (sim_eeprom_busy()) {
+        sim_cycles(SIM_ACCESS_CYCLES);
+    }
+    // the CPU is halted for 4 cycles by a read
+    sim_cycles(2*SIM_ACCESS_CYCLES);
+    return s_eeprom[address & E2END];
+}
+
+uint8_t sim_signature_byte(uint16_t address) {
+    // an arbitrary but stable unique ID
+    return 0x50 + (address & 0x1f);
+}
+
+static void sim_eecr_write(uint8_t old, uint8_t value) {
+    if (value & (1<<EERE)) {
+        if (sim_eeprom_busy()) {
+            sim_error("EEPROM read while a write is running");
+        }
+        s_regs[SIM_REG_EEDR] = s_eeprom[s_eear & E2END];
+    }
+
+    if ((value & (1<<EEMPE)) && !(old & (1<<EEMPE))) {
+        s_eempe_cycle = s_cycles;
+    }
+
+    if ((value & (1<<EEPE)) && !(old & (1<<EEPE))) {
+        uint8_t *const cell = s_eeprom + (s_eear & E2END);
+        const uint8_t data = s_regs[SIM_REG_EEDR];
+
+        if (!(value & (1<<EEMPE)) || s_cycles - s_eempe_cycle > SIM_EEMPE_CYCLES) {
+            sim_error("EEPE set without EEMPE");
+        } else if (sim_spm_busy()) {
+            sim_error("EEPROM write started during SPM");
+        } else if (sim_eeprom_busy()) {
+            sim_error("EEPROM write started while the last one is running");
+        } else {
+            switch ((value >> EEPM0) & 0x03) {
+                case 0: {
+                    *cell = data;
+                    s_eeprom_busy_until = s_cycles + SIM_EEPROM_ATOMIC_CYCLES;
+                } break;
+                case 1: {
+                    *cell = 0xff;
+                    s_eeprom_busy_until = s_cycles + SIM_EEPROM_SPLIT_CYCLES;
+                } break;
+                case 2: {
+                    *cell &= data;
+                    s_eeprom_busy_until = s_cycles + SIM_EEPROM_SPLIT_CYCLES;
+                } break;
+            }
+        }
+    }
+
+    // EERE and EEPE read back as status, see sim_reg8()
+    s_regs[SIM_REG_EECR] = value & ((1<<EEPM1) | (1<<EEPM0) | (1<<EERIE) | (1<<EEMPE));
+}
+
+/**************************************************************************
+ *
+ *  USB endpoints
+ *
+ **************************************************************************/
+
+static sim_ep_t *sim_current_ep(void) {
+    return &s_ep[s_regs[SIM_REG_UENUM] % SIM_EP_COUNT];
+}
+
+static bool sim_ep_is_in(const sim_ep_t *ep) {
+    return ep->uecfg0x & EP_DIR_IN;
+}
+
+static uint8_t sim_ep_banks(const sim_ep_t *ep) {
+    return (ep->uecfg1x & EP_BANKS_MASK) ? 2 : 1;
+}
+
+static bool sim_ep_enabled(const sim_ep_t *ep) {
+    return (ep->ueconx & (1<<EPEN)) && ep != &s_ep[0];
+}
+
+/// The bank that the firmware reads or writes through UEDATX
+static sim_packet_t *sim_fw_bank(sim_ep_t *ep) {
+    if (sim_ep_is_in(ep)) {
+        if (ep->count == sim_ep_banks(ep)) {
+            return NULL;
+        }
+        return &ep->banks[(ep->head + ep->count) % sim_ep_banks(ep)];
+    } else {
+        if (ep->count == 0) {
+            return NULL;
+        }
+        return &ep->banks[ep->head];
+    }
+}
+
+static uint8_t sim_ueintx_value(sim_ep_t *ep) {
+    const sim_packet_t *bank = sim_fw_bank(ep);
+    if (!sim_ep_enabled(ep)) {
+        return 0;
+    }
+    if (bank == NULL) {
+        return ep->nak_flags;
+    }
+    if (sim_ep_is_in(ep)) {
+        return ep->nak_flags | (1<<FIFOCON) | (1<<TXINI) |
+            ((ep->pos < SIM_EP_SIZE) ? (1<<RWAL) : 0);
+    } else {
+        return ep->nak_flags | (1<<FIFOCON) | (1<<RXOUTI) |
+            ((ep->pos < bank->length) ? (1<<RWAL) : 0);
+    }
+}
+
+/// Clearing FIFOCON hands the current bank over to the other side. The NAK
+/// flags are cleared by writing 0 to them.
+static void sim_ueintx_write(sim_ep_t *ep, uint8_t old, uint8_t value) {
+    ep->nak_flags &= value | ~((1<<NAKINI) | (1<<NAKOUTI));
+    if (!(old & (1<<FIFOCON)) || (value & (1<<FIFOCON))) {
+        return;
+    }
+    if (sim_ep_is_in(ep)) {
+        sim_fw_bank(ep)->length = ep->pos;
+        ep->count++;
+    } else {
+        ep->head = (ep->head + 1) % sim_ep_banks(ep);
+        ep->count--;
+    }
+    ep->pos = 0;
+}
+
+volatile uint8_t *sim_uedatx(void) {
+    sim_cycles(SIM_ACCESS_CYCLES);
+    sim_ep_t *ep = sim_current_ep();
+    sim_packet_t *bank = sim_fw_bank(ep);
+
+    if (!sim_ep_enabled(ep) || bank == NULL) {
+        sim_error("UEDATX used without a bank");
+        return &s_dummy;
+    }
+    if (sim_ep_is_in(ep)) {
+        if (ep->pos >= SIM_EP_SIZE) {
+            sim_error("UEDATX written past the end of the bank");
+            return &s_dummy;
+        }
+        return &bank->data[ep->pos++];
+    } else {
+        if (ep->pos >= bank->length) {
+            sim_error("UEDATX read past the end of the packet");
+            return &s_dummy;
+        }
+        return &bank->data[ep->pos++];
+    }
+}
+
+static bool sim_ep_has_type(const sim_ep_t *ep, uint8_t type) {
+    return sim_ep_enabled(ep) && (ep->uecfg0x & EP_TYPE_MASK) == type;
+}
+
+/// Move a packet from the host to a free OUT bank
+static void sim_bus_out(sim_ep_t *ep) {
+    if (!ep->out_pending) {
+        return;
+    }
+    if (ep->count == sim_ep_banks(ep)) {
+        ep->nak_flags |= (1<<NAKOUTI);
+        return;
+    }
+    ep->banks[(ep->head + ep->count) % sim_ep_banks(ep)] = ep->out_packet;
+    ep->count++;
+    ep->out_pending = false;
+}
+
+/// Move a packet from an IN bank to the host
+static void sim_bus_in(sim_ep_t *ep) {
+    if (ep->in_count == SIM_HOST_QUEUE_SIZE) {
+        return;
+    }
+    if (ep->count == 0) {
+        ep->nak_flags |= (1<<NAKINI);
+        return;
+    }
+    const uint8_t tail = (ep->in_head + ep->in_count) % SIM_HOST_QUEUE_SIZE;
+    ep->in_queue[tail] = ep->banks[ep->head];
+    ep->in_count++;
+    ep->head = (ep->head + 1) % sim_ep_banks(ep);
+    ep->count--;
+}
+
+static void sim_bus_frame(void) {
+    if (!s_attached) {
+        return;
+    }
+    s_regs[SIM_REG_UDINT] |= (1<<SOFI);
+    // the host keeps resetting the bus until the device is configured
+    if (s_bus_reset) {
+        s_regs[SIM_REG_UDINT] |= (1<<EORSTI);
+    }
+    for (uint8_t i = 1; i < SIM_EP_COUNT; ++i) {
+        sim_ep_t *ep = &s_ep[i];
+        if (sim_ep_has_type(ep, EP_TYPE_INTERRUPT)) {
+            s_bus_reset = false;
+            if (sim_ep_is_in(ep)) {
+                sim_bus_in(ep);
+            } else {
+                sim_bus_out(ep);
+            }
+        }
+    }
+}
+
+static void sim_bus_bulk_slot(void) {
+    if (!s_attached) {
+        return;
+    }
+    for (uint8_t i = 1; i < SIM_EP_COUNT; ++i) {
+        sim_ep_t *ep = &s_ep[i];
+        if (sim_ep_has_type(ep, EP_TYPE_BULK)) {
+            if (!sim_ep_is_in(ep)) {
+                sim_bus_out(ep);
+            } else if (ep->read_pending && ep->in_count == 0) {
+                sim_bus_in(ep);
+            }
+        }
+    }
+}
+
+/**************************************************************************
+ *
+ *  Registers and time
+ *
+ **************************************************************************/
+
+/// Apply the side effects of a write to the register of the last access
+static void sim_commit(void) {
+    volatile uint8_t *const ptr = s_pending.ptr;
+    if (ptr == NULL) {
+        return;
+    }
+    s_pending.ptr = NULL;
+    if (*ptr == s_pending.value) {
+        return;
+    }
+
+    switch (s_pending.reg) {
+        case SIM_REG_UEINTX: {
+            sim_ueintx_write(&s_ep[s_pending.ep], s_pending.value, *ptr);
+        } break;
+
+        case SIM_REG_EECR: {
+            sim_eecr_write(s_pending.value, *ptr);
+        } break;
+
+        case SIM_REG_UDCON: {
+            const bool attached = !(*ptr & (1<<DETACH));
+            if (attached && !s_attached) {
+                s_bus_reset = true;
+            }
+            s_attached = attached;
+        } break;
+    }
+}
+
+volatile uint8_t *sim_reg8(uint8_t reg) {
+    sim_cycles(SIM_ACCESS_CYCLES);
+
+    sim_ep_t *const ep = sim_current_ep();
+    volatile uint8_t *ptr = &s_regs[reg];
+
+    switch (reg) {
+        case SIM_REG_UEINTX: {
+            ep->ueintx = sim_ueintx_value(ep);
+            ptr = &ep->ueintx;
+        } break;
+
+        case SIM_REG_UEBCLX: {
+            const sim_packet_t *bank = sim_fw_bank(ep);
+            ep->uebclx = 0;
+            if (bank != NULL && !sim_ep_is_in(ep)) {
+                ep->uebclx = bank->length - ep->pos;
+            }
+            ptr = &ep->uebclx;
+        } break;
+
+        case SIM_REG_UECONX: ptr = &ep->ueconx; break;
+        case SIM_REG_UECFG0X: ptr = &ep->uecfg0x; break;
+        case SIM_REG_UECFG1X: ptr = &ep->uecfg1x; break;
+        case SIM_REG_UEIENX: ptr = &ep->ueienx; break;
+
+        case SIM_REG_EECR: {
+            s_regs[reg] &= ~(1<<EEPE);
+            if (s_cycles - s_eempe_cycle > SIM_EEMPE_CYCLES) {
+                s_regs[reg] &= ~(1<<EEMPE);
+            }
+            if (sim_eeprom_busy()) {
+                s_regs[reg] |= (1<<EEPE);
+            }
+        } break;
+
+        case SIM_REG_SPMCSR: {
+            s_regs[reg] =
+                (sim_spm_busy() ? (1<<SPMEN) : 0) |
+                (s_rww_busy ? (1<<RWWSB) : 0);
+        } break;
+
+        case SIM_REG_PLLCSR: {
+            s_regs[reg] |= (1<<PLOCK);
+        } break;
+    }
+
+    s_pending.ptr = ptr;
+    s_pending.reg = reg;
+    s_pending.ep = ep - s_ep;
+    s_pending.value = *ptr;
+    return ptr;
+}
+
+volatile uint16_t *sim_reg_eear(void) {
+    sim_cycles(SIM_ACCESS_CYCLES);
+    return &s_eear;
+}
+
+/// TCNT1 counts from power on with the prescaler currently in TCCR1B,
+/// writes to it are ignored
+volatile uint16_t *sim_reg_tcnt1(void) {
+    static const uint16_t prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+    sim_cycles(SIM_ACCESS_CYCLES);
+    const uint16_t div = prescale[s_regs[SIM_REG_TCCR1B] & 0x07];
+    s_tcnt1 = div ? (uint16_t)(s_cycles / div) : 0;
+    return &s_tcnt1;
+}
+
+/// Suspend the firmware if what the host is waiting for has happened
+static void sim_yield(void) {
+    if (!s_wait) {
+        return;
+    }
+    if (s_reset || s_cycles >= s_deadline || s_wait()) {
+        swapcontext(&s_fw_ctx, &s_host_ctx);
+    }
+}
+
+void sim_cycles(uint32_t cycles) {
+    const uint64_t end = s_cycles + cycles;
+
+    // writes made through the last register access take effect first
+    sim_commit();
+
+    while (1) {
+        uint64_t next = end;
+        if (s_next_frame < next) {
+            next = s_next_frame;
+        }
+        if (s_next_bulk_slot < next) {
+            next = s_next_bulk_slot;
+        }
+        s_cycles = next;
+
+        if (s_cycles == s_next_frame) {
+            sim_bus_frame();
+            s_next_frame += SIM_FRAME_CYCLES;
+        }
+        if (s_cycles == s_next_bulk_slot) {
+            sim_bus_bulk_slot();
+            s_bulk_slot = (s_bulk_slot + 1) % SIM_BULK_SLOTS;
+            s_next_bulk_slot = s_next_frame - SIM_FRAME_CYCLES +
+                (s_bulk_slot + 1) * SIM_FRAME_CYCLES / SIM_BULK_SLOTS;
+        }
+
+        if (s_wdt_timeout && s_cycles - s_wdt_last > s_wdt_timeout) {
+            // the bootloader has finished, or is stuck
+            s_reset = true;
+            s_attached = false;
+        }
+
+        sim_yield();
+
+        if (s_cycles >= end) {
+            break;
+        }
+    }
+}
+
+void sim_delay_us(uint32_t us) {
+    sim_cycles(SIM_US(us));
+}
+
+void sim_wdt_reset(void) {
+    s_wdt_last = s_cycles;
+}
+
+void sim_wdt_enable(uint8_t timeout) {
+    // WDTO_15MS is 2k cycles of the 128kHz oscillator, each step doubles it
+    s_wdt_timeout = SIM_US(16000) << timeout;
+    s_wdt_last = s_cycles;
+}
+
+void sim_sleep(void) {
+    // only the bus can wake the CPU up
+    uint64_t next = s_next_frame;
+    if (s_next_bulk_slot < next) {
+        next = s_next_bulk_slot;
+    }
+    sim_cycles(next - s_cycles);
+}
+
+/**************************************************************************
+ *
+ *  Host side
+ *
+ **************************************************************************/
+
+static void sim_firmware_main(void) {
+    // the same steps as main() in src/main.c, minus the application checks
+    wdt_enable(WDTO_500MS);
+    usb_init();
+
+    while (1) {
+        usb_poll();
+        wdt_reset();
+#if USE_USB_INTERRUPTS
+        usb_sleep();
+#endif
+    }
+}
+
+static bool sim_never(void) {
+    return false;
+}
+
+static bool sim_out_done(void) {
+    return !s_ep[s_wait_ep].out_pending || !s_attached;
+}
+
+static bool sim_in_ready(void) {
+    return s_ep[s_wait_ep].in_count || !s_attached;
+}
+
+/// Run the firmware until `done` returns true or `us` microseconds pass
+static void sim_run(bool (*done)(void), uint64_t us) {
+    if (s_reset) {
+        return;
+    }
+    s_wait = done;
+    s_deadline = s_cycles + SIM_US(us);
+    swapcontext(&s_host_ctx, &s_fw_ctx);
+    s_wait = NULL;
+}
+
+int sim_power_on(void) {
+    if (s_powered) {
+        return SIM_ERR_ARG;
+    }
+    sim_mem_init();
+    s_powered = true;
+    s_next_frame = SIM_FRAME_CYCLES;
+    s_next_bulk_slot = SIM_FRAME_CYCLES / SIM_BULK_SLOTS;
+    s_regs[SIM_REG_UDCON] = (1<<DETACH);
+
+    getcontext(&s_fw_ctx);
+    s_fw_ctx.uc_stack.ss_sp = malloc(SIM_STACK_SIZE);
+    s_fw_ctx.uc_stack.ss_size = SIM_STACK_SIZE;
+    s_fw_ctx.uc_link = NULL;
+    makecontext(&s_fw_ctx, sim_firmware_main, 0);
+
+    // let usb_init() finish and the host configure the device
+    sim_run(sim_never, 50000);
+    return s_attached ? SIM_OK : SIM_ERR_DETACHED;
+}
+
+int sim_write(uint8_t ep_num, const uint8_t *data, uint8_t length) {
+    if (ep_num == 0 || ep_num >= SIM_EP_COUNT || length > SIM_EP_SIZE) {
+        return SIM_ERR_ARG;
+    }
+    if (!s_attached) {
+        return SIM_ERR_DETACHED;
+    }
+    sim_ep_t *ep = &s_ep[ep_num];
+    memcpy(ep->out_packet.data, data, length);
+    ep->out_packet.length = length;
+    ep->out_pending = true;
+
+    s_wait_ep = ep_num;
+    sim_run(sim_out_done, 1000 * SIM_HOST_TIMEOUT_MS);
+    if (ep->out_pending) {
+        ep->out_pending = false;
+        return s_attached ? SIM_ERR_TIMEOUT : SIM_ERR_DETACHED;
+    }
+    return SIM_OK;
+}
+
+int sim_read(uint8_t ep_num, uint8_t *data, uint32_t timeout_ms) {
+    if (ep_num == 0 || ep_num >= SIM_EP_COUNT) {
+        return SIM_ERR_ARG;
+    }
+    sim_ep_t *ep = &s_ep[ep_num];
+
+    if (!ep->in_count) {
+        if (!s_attached) {
+            return SIM_ERR_DETACHED;
+        }
+        ep->read_pending = true;
+        s_wait_ep = ep_num;
+        sim_run(sim_in_ready, 1000 * (uint64_t)timeout_ms);
+        ep->read_pending = false;
+        if (!ep->in_count) {
+            return s_attached ? SIM_ERR_TIMEOUT : SIM_ERR_DETACHED;
+        }
+    }
+
+    const sim_packet_t *packet = &ep->in_queue[ep->in_head];
+    ep->in_head = (ep->in_head + 1) % SIM_HOST_QUEUE_SIZE;
+    ep->in_count--;
+    memcpy(data, packet->data, packet->length);
+    return packet->length;
+}
+
+/// Let the firmware run while the host does nothing
+int sim_idle(uint32_t us) {
+    sim_run(sim_never, us);
+    return s_reset ? SIM_ERR_DETACHED : SIM_OK;
+}
+
+uint64_t sim_time_us(void) {
+    return s_cycles / (SIM_F_CPU / 1000000);
+}
+
+static uint8_t *sim_space(uint8_t space, uint16_t address, uint16_t length) {
+    sim_mem_init();
+    if (space == SIM_SPACE_FLASH && (uint32_t)address + length <= sizeof(s_flash)) {
+        return s_flash + address;
+    }
+    if (space == SIM_SPACE_EEPROM && (uint32_t)address + length <= sizeof(s_eeprom)) {
+        return s_eeprom + address;
+    }
+    return NULL;
+}
+
+int sim_load(uint8_t space, uint16_t address, const uint8_t *data, uint16_t length) {
+    uint8_t *mem = sim_space(space, address, length);
+    if (mem == NULL) {
+        return SIM_ERR_ARG;
+    }
+    memcpy(mem, data, length);
+    return SIM_OK;
+}
+
+int sim_dump(uint8_t space, uint16_t address, uint8_t *data, uint16_t length) {
+    const uint8_t *mem = sim_space(space, address, length);
+    if (mem == NULL) {
+        return SIM_ERR_ARG;
+    }
+    memcpy(data, mem, length);
+    return SIM_OK;
+}
+
+/// Number of times the firmware used the hardware in a way that would
+/// misbehave on a real chip
+uint32_t sim_errors(void) {
+    return s_errors;
+}
@@ -0,0 +1,87 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// Native emulator of the ATmega32u4 parts used by the bootloader.
+//
+// The bootloader sources are built for the host against the headers in
+// `sim/include`, which replace the avr-libc ones. Every register access goes
+// through `sim_reg8()`, which advances a cycle counter and applies the side
+// effects of the previous access, so the firmware's busy loops see flash
+// and EEPROM operations finish, and USB packets arrive on 1ms frames.
+
+#pragma once
+
+#include <stdint.h>
+
+#define SIM_F_CPU 16000000UL
+
+// Registers that the emulator knows about. The USB endpoint registers are
+// banked by UENUM, like on the real chip.
+enum {
+    SIM_REG_UENUM,
+    SIM_REG_UEINTX,
+    SIM_REG_UEBCLX,
+    SIM_REG_UECONX,
+    SIM_REG_UECFG0X,
+    SIM_REG_UECFG1X,
+    SIM_REG_UEIENX,
+    SIM_REG_UERST,
+    SIM_REG_UEINT,
+    SIM_REG_UDINT,
+    SIM_REG_UDIEN,
+    SIM_REG_UDCON,
+    SIM_REG_UDADDR,
+    SIM_REG_UHWCON,
+    SIM_REG_USBCON,
+    SIM_REG_PLLCSR,
+    SIM_REG_EECR,
+    SIM_REG_EEDR,
+    SIM_REG_SPMCSR,
+    SIM_REG_MCUCR,
+    SIM_REG_MCUSR,
+    SIM_REG_CLKPR,
+    SIM_REG_WDTCSR,
+    SIM_REG_TCCR1A,
+    SIM_REG_TCCR1B,
+    SIM_REG_COUNT,
+};
+
+// register layer, used by the macros in `sim/include/avr/io.h`
+volatile uint8_t *sim_reg8(uint8_t reg);
+volatile uint16_t *sim_reg_eear(void);
+volatile uint16_t *sim_reg_tcnt1(void);
+volatile uint8_t *sim_uedatx(void);
+
+// memories and timed operations, used by the other mock headers
+void sim_spm(uint16_t address, uint8_t spmcsr, uint16_t value);
+void sim_spm_wait(void);
+uint8_t sim_pgm_read_byte(uint16_t address);
+uint8_t sim_eeprom_read_byte(uint16_t address);
+uint8_t sim_signature_byte(uint16_t address);
+void sim_delay_us(uint32_t us);
+void sim_cycles(uint32_t cycles);
+void sim_wdt_reset(void);
+void sim_wdt_enable(uint8_t timeout);
+void sim_sleep(void);
+
+// API used by the host side (kp_boot_32u4/sim.py)
+enum {
+    SIM_OK = 0,
+    SIM_ERR_TIMEOUT = -1,
+    SIM_ERR_DETACHED = -2,
+    SIM_ERR_ARG = -3,
+};
+
+enum {
+    SIM_SPACE_FLASH = 0,
+    SIM_SPACE_EEPROM = 1,
+};
+
+int sim_power_on(void);
+int sim_write(uint8_t ep, const uint8_t *data, uint8_t length);
+int sim_read(uint8_t ep, uint8_t *data, uint32_t timeout_ms);
+int sim_idle(uint32_t us);
+uint64_t sim_time_us(void);
+int sim_load(uint8_t space, uint16_t address, const uint8_t *data, uint16_t length);
+int sim_dump(uint8_t space, uint16_t address, uint8_t *data, uint16_t length);
+uint32_t sim_errors(void);
@@ -0,0 +1,38 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+// C versions of the functions in src/spm.S for the native emulator. They
+// charge roughly the same number of cycles as the assembly.
+
+#include <avr/io.h>
+
+#include "sim.h"
+
+void spm_leap_cmd(uint16_t addr, uint8_t spmCmd, uint8_t spmCmd2, uint16_t optValue) {
+    sim_spm(addr, spmCmd, optValue);
+    sim_spm_wait();
+    if (spmCmd2) {
+        sim_spm(addr, spmCmd2, optValue);
+    }
+}
+
+void spm_fill_from_fifo(uint16_t address, uint8_t count) {
+    for (; count; --count) {
+        const uint8_t lo = UEDATX;
+        const uint8_t hi = UEDATX;
+        sim_spm_wait();
+        sim_spm(address, (1<<SPMEN), (hi << 8) | lo);
+        sim_cycles(5);
+        address += 2;
+    }
+}
+
+void spm_fill_page(uint16_t address, const uint8_t *buf) {
+    for (uint8_t i = 0; i < SPM_PAGESIZE/2; ++i) {
+        sim_spm_wait();
+        sim_spm(address, (1<<SPMEN), (buf[1] << 8) | buf[0]);
+        sim_cycles(9);
+        address += 2;
+        buf += 2;
+    }
+}
@@ -0,0 +1,25 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+#pragma once
+
+// Markers for the cycle benchmark in `bench/`, which runs the bootloader
+// under simavr and records the cycle count whenever one of them is written
+// to GPIOR0. Each marker costs 2 cycles, and they are only compiled in with
+// USE_BENCH_MARKERS.
+enum {
+    BENCH_MARK_NONE = 0,
+    BENCH_MARK_POLL_START,
+    BENCH_MARK_POLL_END,
+    BENCH_MARK_EP0_START,
+    BENCH_MARK_EP0_END,
+    BENCH_MARK_CMD_START,
+    BENCH_MARK_CMD_END,
+    BENCH_MARK_COUNT,
+};
+
+#if USE_BENCH_MARKERS
+#define BENCH_MARK(id) (GPIOR0 = (id))
+#else
+#define BENCH_MARK(id)
+#endif
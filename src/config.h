@@ -3,7 +3,160 @@
 
 #pragma once
 
-#define BOOTLOADER_VERSION 0
+#define BOOTLOADER_VERSION 1
+
+// Optional commands, enabled from the board config.mk. None of them fit in
+// the 1kb boot section.
+#ifndef USE_WRITE_PAGE
+#define USE_WRITE_PAGE 0
+#endif
+
+#ifndef USE_ERASE_CMD
+#define USE_ERASE_CMD 0
+#endif
+
+// Skip unchanged EEPROM bytes and use the split erase/write modes, see
+// eeprom_update()
+#ifndef USE_EEPROM_UPDATE
+#define USE_EEPROM_UPDATE 0
+#endif
+
+// Feed the page buffer fills of USB_CMD_SPM from the USB FIFO, see
+// spm_fill_from_fifo()
+#ifndef USE_SPM_FIFO
+#define USE_SPM_FIFO 0
+#endif
+
+#ifndef USE_READ_CMD
+#define USE_READ_CMD 0
+#endif
+
+#ifndef USE_CRC_CMD
+#define USE_CRC_CMD 0
+#endif
+
+#ifndef USE_PAGE_STAGING
+#define USE_PAGE_STAGING 0
+#endif
+
+#ifndef USE_WRITE_PAGE_LZ
+#define USE_WRITE_PAGE_LZ 0
+#endif
+
+#ifndef USE_EEPROM_QUEUE
+#define USE_EEPROM_QUEUE 0
+#endif
+
+#ifndef USE_BULK_ENDPOINTS
+#define USE_BULK_ENDPOINTS 0
+#endif
+
+#ifndef USE_CONTROL_PAGE
+#define USE_CONTROL_PAGE 0
+#endif
+
+#ifndef USE_SERIAL_NUMBER
+#define USE_SERIAL_NUMBER 0
+#endif
+
+// Jump table of flash services for the application, see usb.c
+#ifndef USE_BOOT_SERVICES
+#define USE_BOOT_SERVICES 0
+#endif
+
+// Boot service that keeps some interrupts running while the application
+// section is busy, see boot_service_spm()
+#ifndef USE_RWW_ISR
+#define USE_RWW_ISR 0
+#endif
+
+#if USE_RWW_ISR && !USE_BOOT_SERVICES
+#error "USE_RWW_ISR needs USE_BOOT_SERVICES"
+#endif
+
+// Sleep between USB events instead of busy polling, see usb_sleep()
+#ifndef USE_USB_INTERRUPTS
+#define USE_USB_INTERRUPTS 0
+#endif
+
+// These all program pages through the receive buffer of USB_CMD_WRITE_PAGE
+#if (USE_PAGE_STAGING || USE_WRITE_PAGE_LZ || USE_CONTROL_PAGE || \
+    USE_BOOT_SERVICES) && !USE_WRITE_PAGE
+#error "USE_PAGE_STAGING, USE_WRITE_PAGE_LZ, USE_CONTROL_PAGE and USE_BOOT_SERVICES need USE_WRITE_PAGE"
+#endif
+
+#if USE_EEPROM_QUEUE && !USE_EEPROM_UPDATE
+#error "USE_EEPROM_QUEUE needs USE_EEPROM_UPDATE"
+#endif
+
+#if USE_RWW_ISR && USE_USB_INTERRUPTS
+#error "USE_RWW_ISR and USE_USB_INTERRUPTS both need the USB vectors"
+#endif
+
+// Timer1 based counters read with USB_CMD_STATS
+#ifndef USE_PERF_COUNTERS
+#define USE_PERF_COUNTERS 0
+#endif
+
+// Cycle count markers for the simavr benchmark, see bench.h
+#ifndef USE_BENCH_MARKERS
+#define USE_BENCH_MARKERS 0
+#endif
+
+// USB_CMD_SYNC is needed when writes can complete in the background
+#define USE_SYNC_CMD (USE_PAGE_STAGING || USE_EEPROM_QUEUE)
+
+// Control reads longer than one packet, see usb_ep0_write()
+#define USE_EP0_MULTI_PACKET (USE_CONTROL_PAGE || USE_BULK_ENDPOINTS)
+
+// Bit flags reported in the response to every command so the host can tell
+// which optional commands the bootloader was built with. Only valid when
+// BOOTLOADER_VERSION >= 1.
+//
+// FEATURE_STATUS: responses carry a status code and the sequence tag of the
+// command they answer, so the host may keep several commands in flight.
+#define FEATURE_STATUS          (1<<0)
+// FEATURE_WRITE_PAGE: supports USB_CMD_WRITE_PAGE
+#define FEATURE_WRITE_PAGE      (1<<1)
+// FEATURE_ERASE: supports erasing a range of pages with USB_CMD_ERASE
+#define FEATURE_ERASE           (1<<2)
+// FEATURE_SMART_PAGE: USB_CMD_WRITE_PAGE skips unchanged pages and needless
+// erases, and reports what it did in the response
+#define FEATURE_SMART_PAGE      (1<<3)
+// FEATURE_READ: supports streaming flash and EEPROM with USB_CMD_READ
+#define FEATURE_READ            (1<<4)
+// FEATURE_CRC: supports USB_CMD_CRC
+#define FEATURE_CRC             (1<<5)
+// FEATURE_PAGE_STAGING: USB_CMD_WRITE_PAGE programs pages in the background,
+// and USB_CMD_SYNC is supported
+#define FEATURE_PAGE_STAGING    (1<<6)
+// FEATURE_EEPROM_UPDATE: USB_CMD_WRITE_EEPROM skips unchanged bytes and
+// reports the number of bytes programmed
+#define FEATURE_EEPROM_UPDATE   (1<<7)
+// FEATURE_EEPROM_QUEUE: USB_CMD_WRITE_EEPROM only queues the data, and
+// USB_CMD_SYNC is supported
+#define FEATURE_EEPROM_QUEUE    (1<<8)
+// FEATURE_WRITE_PAGE_LZ: USB_CMD_WRITE_PAGE_LZ is supported
+#define FEATURE_WRITE_PAGE_LZ   (1<<9)
+// FEATURE_CONTROL_PAGE: whole pages can be written with a feature report
+#define FEATURE_CONTROL_PAGE    (1<<10)
+// FEATURE_PERF_COUNTERS: USB_CMD_STATS returns the performance counters
+#define FEATURE_PERF_COUNTERS   (1<<11)
+
+#define BOOTLOADER_FEATURES ( \
+    FEATURE_STATUS | \
+    (USE_WRITE_PAGE ? (FEATURE_WRITE_PAGE | FEATURE_SMART_PAGE) : 0) | \
+    (USE_ERASE_CMD ? FEATURE_ERASE : 0) | \
+    (USE_EEPROM_UPDATE ? FEATURE_EEPROM_UPDATE : 0) | \
+    (USE_READ_CMD ? FEATURE_READ : 0) | \
+    (USE_CRC_CMD ? FEATURE_CRC : 0) | \
+    (USE_PAGE_STAGING ? FEATURE_PAGE_STAGING : 0) | \
+    (USE_EEPROM_QUEUE ? FEATURE_EEPROM_QUEUE : 0) | \
+    (USE_WRITE_PAGE_LZ ? FEATURE_WRITE_PAGE_LZ : 0) | \
+    (USE_CONTROL_PAGE ? FEATURE_CONTROL_PAGE : 0) | \
+    (USE_PERF_COUNTERS ? FEATURE_PERF_COUNTERS : 0) | \
+    0 \
+)
 
 #define CHIP_ID_MASK 0x3F
 enum {
@@ -0,0 +1,78 @@
+# Copyright 2018 jem@seethis.link
+# Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+# Turns the USE_* options set in `boards/*/config.mk` into defines. Shared by
+# the firmware build and the native emulator in `sim/`.
+
+# The asm routines for these are in spm.S, so the assembler needs them too
+ifeq ($(USE_WRITE_PAGE), 1)
+  CFLAGS += -DUSE_WRITE_PAGE=1
+  ADEFS += -DUSE_WRITE_PAGE=1
+endif
+
+ifeq ($(USE_SPM_FIFO), 1)
+  CFLAGS += -DUSE_SPM_FIFO=1
+  ADEFS += -DUSE_SPM_FIFO=1
+endif
+
+ifeq ($(USE_ERASE_CMD), 1)
+  CFLAGS += -DUSE_ERASE_CMD=1
+endif
+
+ifeq ($(USE_EEPROM_UPDATE), 1)
+  CFLAGS += -DUSE_EEPROM_UPDATE=1
+endif
+
+ifeq ($(USE_READ_CMD), 1)
+  CFLAGS += -DUSE_READ_CMD=1
+endif
+
+ifeq ($(USE_CRC_CMD), 1)
+  CFLAGS += -DUSE_CRC_CMD=1
+endif
+
+ifeq ($(USE_PAGE_STAGING), 1)
+  CFLAGS += -DUSE_PAGE_STAGING=1
+endif
+
+ifeq ($(USE_EEPROM_QUEUE), 1)
+  CFLAGS += -DUSE_EEPROM_QUEUE=1
+endif
+
+ifeq ($(USE_WRITE_PAGE_LZ), 1)
+  CFLAGS += -DUSE_WRITE_PAGE_LZ=1
+endif
+
+ifeq ($(USE_BULK_ENDPOINTS), 1)
+  CFLAGS += -DUSE_BULK_ENDPOINTS=1
+endif
+
+ifeq ($(USE_CONTROL_PAGE), 1)
+  CFLAGS += -DUSE_CONTROL_PAGE=1
+endif
+
+ifeq ($(USE_SERIAL_NUMBER), 1)
+  CFLAGS += -DUSE_SERIAL_NUMBER=1
+endif
+
+ifeq ($(USE_BOOT_SERVICES), 1)
+  CFLAGS += -DUSE_BOOT_SERVICES=1
+endif
+
+ifeq ($(USE_RWW_ISR), 1)
+  CFLAGS += -DUSE_RWW_ISR=1
+  ADEFS += -DUSE_RWW_ISR=1
+endif
+
+ifeq ($(USE_USB_INTERRUPTS), 1)
+  CFLAGS += -DUSE_USB_INTERRUPTS=1
+  ADEFS += -DUSE_USB_INTERRUPTS=1
+endif
+
+ifeq ($(USE_PERF_COUNTERS), 1)
+  CFLAGS += -DUSE_PERF_COUNTERS=1
+endif
+
+ifeq ($(USE_BENCH_MARKERS), 1)
+  CFLAGS += -DUSE_BENCH_MARKERS=1
+endif
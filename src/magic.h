@@ -0,0 +1,19 @@
+// Copyright 2018 jem@seethis.link
+// Licensed under the MIT license (http://opensource.org/licenses/MIT)
+
+#pragma once
+
+// Shared by main.c and early_boot.S. The application and the bootloader pass
+// the reason for a reset in SRAM at this address.
+//
+// Note: the bootloader's .data starts at 0x200, above this address, see the
+// Makefile and ld_scripts/avr5.xn
+#define MAGIC_ADDRESS (0x200-4)
+#define MAGIC_ENTER_BOOT (0xda54)
+#define MAGIC_ENTER_APPL (~0xda54)
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+typedef uint16_t magic_t;
+#endif
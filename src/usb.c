@@ -25,11 +25,17 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include <util/crc16.h>
 #include <util/delay.h>
+#include <avr/boot.h>
 #include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <avr/wdt.h>
 
 #include "usb.h"
+#include "bench.h"
 
 #include "usb/descriptors.h"
 #include "usb/util/usb_hid.h"
@@ -40,6 +46,10 @@
  *
  **************************************************************************/
 
+#if USE_SERIAL_NUMBER
+static void make_serial_string(void);
+#endif
+
 // initialize USB
 void usb_init(void) {
     HW_CONFIG();
@@ -49,6 +59,22 @@ void usb_init(void) {
 
     USB_CONFIG();   // start USB clock
 
+#if USE_PERF_COUNTERS
+    // free running Timer1 at F_CPU/64 for the performance counters
+    TCCR1A = 0;
+    TCCR1B = (1<<CS11) | (1<<CS10);
+#endif
+
+#if USE_SERIAL_NUMBER
+    make_serial_string();
+#endif
+
+#if USE_USB_INTERRUPTS
+    // The vector table is at the start of the boot section, see early_boot.S
+    MCUCR = (1<<IVCE);
+    MCUCR = (1<<IVSEL);
+#endif
+
     UDCON = 1;      // disconnect attach resistor
     _delay_ms(10);
     UDCON = 0;      // enable attach resistor
@@ -119,23 +145,15 @@ void usb_ack_out(void) {
 
 #include "usb/util/usb_hid.h"
 
-#if 0
-#define MAX_STRING_LEN 32
-uint16_t string_desc_buf[MAX_STRING_LEN+32+1];
-char string_copy_buf[MAX_STRING_LEN+32];
-static uint8_t s_serial_string_write_pos;
+#if USE_SERIAL_NUMBER
+// The serial number is the unique ID from the signature row as a hex string.
+// It is read once at start up, since the signature row can't be read while
+// an SPM operation is running.
+#define SERIAL_SIG_START_ADDR 0x0E
+#define SERIAL_LENGTH 10
 
-static void make_string_desc(char *str) {
-    char c;
-    uint8_t i = 0;
-    uint8_t len = 0;
-    while ( ((c = str[i]) != '\0') && len != MAX_STRING_LEN) {
-        string_desc_buf[i+1] = c; // char -> uint16_t
-        len++;
-        i++;
-    }
-    string_desc_buf[0] = USB_STRING_DESC_SIZE((len+1)*sizeof(uint16_t));
-}
+// string descriptor: header followed by two UTF-16 characters per byte
+static uint16_t s_serial_desc[1 + 2*SERIAL_LENGTH];
 
 static char hexdigit_to_char(uint8_t d) {
     d = d & 0x0f;
@@ -146,27 +164,61 @@ static char hexdigit_to_char(uint8_t d) {
     }
 }
 
-static void write_serial_helper(uint8_t byte) {
-    string_copy_buf[s_serial_string_write_pos++] = byte;
+static void make_serial_string(void) {
+    for (uint8_t i = 0; i < SERIAL_LENGTH; ++i) {
+        const uint8_t byte = boot_signature_byte_get(SERIAL_SIG_START_ADDR + i);
+        s_serial_desc[1 + 2*i + 0] = hexdigit_to_char(byte >> 4);
+        s_serial_desc[1 + 2*i + 1] = hexdigit_to_char(byte >> 0);
+    }
+    s_serial_desc[0] = USB_STRING_DESC_SIZE(sizeof(s_serial_desc));
 }
+#endif
 
-static void write_serial_hex_byte(uint8_t hex_char) {
-    write_serial_helper(hexdigit_to_char(hex_char >> 4));
-    write_serial_helper(hexdigit_to_char(hex_char >> 0));
-}
+#if USE_EP0_MULTI_PACKET
+/// Send `length` bytes from `src` as the data stage of a control read,
+/// split into as many packets as needed. `max_length` is the wLength of the
+/// request.
+static void usb_ep0_write(const uint8_t *src, uint16_t length, uint16_t max_length) {
+    uint8_t count;
 
-#define SERIAL_SIG_START_ADDR 0x0E
-#define SERIAL_SIG_END_ADDR 0x18
-#define SERIAL_LENGTH 10
-static void make_serial_string(void) {
-    s_serial_string_write_pos = 0;
-    uint8_t i;
-    for (i = 0; i < SERIAL_LENGTH; ++i) {
-        write_serial_hex_byte(
-            boot_signature_byte_get(SERIAL_SIG_START_ADDR + i)
-        );
+    if (length > max_length) {
+        length = max_length;
+    }
+
+    // A transfer that ends with a full packet needs a zero length packet
+    // if the host asked for more data than that.
+    do {
+        uint8_t flags;
+        do {
+            flags = UEINTX;
+        } while (!(flags & ((1<<TXINI) | (1<<RXOUTI))));
+
+        // the host started the status stage early
+        if (flags & (1<<RXOUTI)) {
+            return;
+        }
+
+        count = (length < EP0_SIZE) ? length : EP0_SIZE;
+        for (uint8_t i = count; i; i--) {
+            UEDATX = *src++;
+        }
+        length -= count;
+        max_length -= count;
+        usb_send_in();
+    } while (length || (count == EP0_SIZE && max_length));
+}
+#else
+/// Send `length` bytes from `src` as the data stage of a control read. All
+/// the descriptors of this build fit in one packet. `max_length` is the
+/// wLength of the request.
+static void usb_ep0_write(const uint8_t *src, uint16_t length, uint16_t max_length) {
+    if (length > max_length) {
+        length = max_length;
     }
-    write_serial_helper('\0'); // (1 byte)
+    for (uint8_t i = length; i; i--) {
+        UEDATX = *src++;
+    }
+    usb_send_in();
 }
 #endif
 
@@ -189,43 +241,24 @@ static void usb_handle_ep0(usb_request_t *req) {
                     length  = sizeof(usb_config_desc);
                 } break;
 
-#if 0//#if
+#if USE_SERIAL_NUMBER
                 // USB Host requested a string descriptor
                 case USB_DESC_STRING: {
                     switch (req->get_desc.index) {
-                        // case STRING_DESC_PRODUCT: {
-                        //     ptr->type = PTR_DATA;
-                        //     flash_read(
-                        //         (uint8_t*) string_copy_buf,
-                        //         (flash_ptr_t)&(GET_SETTING(device_name)),
-                        //         MAX_STRING_LEN
-                        //     );
-                        //     make_string_desc(string_copy_buf);
-                        //     address = (raw_ptr_t)string_desc_buf;
-                        // } break;
-
                         case STRING_DESC_SERIAL_NUMBER: {
-                            make_serial_string();
-                            make_string_desc(string_copy_buf);
-                            address = (raw_ptr_t)string_desc_buf;
+                            address = (uint8_t*)s_serial_desc;
                         } break;
 
-                        case STRING_DESC_MANUFACTURER: {
-                            address = (raw_ptr_t)((uint8_t*)usb_string_desc_1);
-                        } break;
-
-                        default:
                         case STRING_DESC_NONE: {
-                            address = (raw_ptr_t)((uint8_t*)usb_string_desc_0);
+                            address = (uint8_t*)usb_string_desc_0;
                         } break;
-
                     }
 
-                    if (address != 0) {
+                    if (address != NULL) {
                         length = ((usb_string_desc_t*)address)->bLength;
                     }
                 } break;
-#endif//#endif
+#endif
 
                 // USB Host requested a HID descriptor
                 case USB_DESC_HID_REPORT: {
@@ -241,22 +274,10 @@ static void usb_handle_ep0(usb_request_t *req) {
 
             if (address == NULL) {
                 USB_EP0_STALL();
+                return;
             }
 
-            // All our USB descriptors fit in one packet, so don't need to
-            // worry about packetizing them.
-            {
-                uint8_t len = (req->std.wLength < 256) ? req->std.wLength : 255;
-
-                if (len > length) {
-                    len = length;
-                }
-
-                for (uint8_t i = len; i; i--) {
-                    UEDATX = *address++;
-                }
-                usb_send_in();
-            }
+            usb_ep0_write(address, length, req->std.wLength);
 
         } break;
 
@@ -350,6 +371,20 @@ static void usb_hid_request(usb_request_std_t *req) {
 
 #define MAX_EP_NUM 2
 
+#if USE_BULK_ENDPOINTS
+#define MAX_EP_NUM_USED EP_NUM_BULK_OUT
+#else
+#define MAX_EP_NUM_USED EP_NUM_VENDOR_OUT
+#endif
+
+#if USE_USB_INTERRUPTS
+// Set when a start of frame has been seen since the last usb_sleep(). The
+// CPU only sleeps while the host is sending them, so the SOF interrupt is
+// sure to wake it up every millisecond to reset the watchdog. While the bus
+// is suspended, the bootloader polls as usual.
+static bool s_sof_seen;
+#endif
+
 // USB Device Interrupt - handle all device-level events
 // the transmit buffer flushing is triggered by the start of frame
 static void usb_gen_isr(void) {
@@ -359,6 +394,12 @@ static void usb_gen_isr(void) {
     irq_flags = UDINT;
     UDINT = 0;
 
+#if USE_USB_INTERRUPTS
+    if (irq_flags & (1<<SOFI)) {
+        s_sof_seen = true;
+    }
+#endif
+
     // if (has_seen_setup_packet) {
     //     wdt_reset();
     // }
@@ -390,13 +431,27 @@ static void usb_gen_isr(void) {
         UECONX = (1<<EPEN);
 
         UECFG0X = EP_TYPE_INTERRUPT_IN;
-        UECFG1X = EP_SIZE(ENDPOINT0_SIZE) | EP_SINGLE_BUFFER;
+        UECFG1X = EP_SIZE(EP_SIZE_VENDOR) | EP_BUFFERING_VENDOR;
 
         UENUM = EP_NUM_VENDOR_OUT;
         UECONX = (1<<EPEN);
 
         UECFG0X = EP_TYPE_INTERRUPT_OUT;
-        UECFG1X = EP_SIZE(ENDPOINT0_SIZE) | EP_SINGLE_BUFFER;
+        UECFG1X = EP_SIZE(EP_SIZE_VENDOR) | EP_BUFFERING_VENDOR;
+
+#if USE_BULK_ENDPOINTS
+        UENUM = EP_NUM_BULK_IN;
+        UECONX = (1<<EPEN);
+
+        UECFG0X = EP_TYPE_BULK_IN;
+        UECFG1X = EP_SIZE(EP_SIZE_BULK) | EP_BUFFERING_VENDOR;
+
+        UENUM = EP_NUM_BULK_OUT;
+        UECONX = (1<<EPEN);
+
+        UECFG0X = EP_TYPE_BULK_OUT;
+        UECFG1X = EP_SIZE(EP_SIZE_BULK) | EP_BUFFERING_VENDOR;
+#endif
 #endif
 
         UERST = 0;
@@ -419,6 +474,10 @@ static void usb_gen_isr(void) {
     // }
 }
 
+#if USE_CONTROL_PAGE
+static void usb_hid_feature_request(usb_request_t *req);
+#endif
+
 // USB Endpoint Interrupt - endpoint 0 is handled here.  The
 // other endpoints are manipulated by the user-callable
 // functions, and the start-of-frame interrupt.
@@ -431,6 +490,7 @@ static void usb_com_isr(void) {
     if ( !(is_setup_packet(UEINTX) ) ) {
         return;
     }
+    BENCH_MARK(BENCH_MARK_EP0_START);
 
     usb_read_endpoint(0, (uint8_t*)&req);
     UEINTX = ~((1<<RXSTPI) | (1<<RXOUTI) | (1<<TXINI));
@@ -487,11 +547,18 @@ static void usb_com_isr(void) {
         //     usb_hid_request((usb_request_std_t*)&req);
         // } break;
 
+#if USE_CONTROL_PAGE
+        case (USB_REQTYPE_TYPE_CLASS << 5): {
+            usb_hid_feature_request(&req);
+        } break;
+#endif
+
         default: {
             // stall on unsupported requests
             USB_EP0_STALL();
         } break;
     }
+    BENCH_MARK(BENCH_MARK_EP0_END);
 }
 
 enum {
@@ -501,121 +568,1399 @@ enum {
     USB_CMD_SPM = 3,
     USB_CMD_WRITE_EEPROM = 4,
     USB_CMD_RESET = 5,
+    USB_CMD_WRITE_PAGE = 6,
+    USB_CMD_READ = 7,
+    USB_CMD_CRC = 8,
+    USB_CMD_SYNC = 9,
+    USB_CMD_WRITE_PAGE_LZ = 10,
+    USB_CMD_STATS = 11,
 };
 
-static void spm_leap_cmd(uint16_t addr, uint8_t spmCmd, uint8_t spmCmd2, uint16_t optValue);
+enum {
+    USB_STATUS_OK = 0,
+    USB_STATUS_UNKNOWN_CMD = 1,
+    USB_STATUS_BAD_ARG = 2,
+};
 
-void usb_poll(void) {
-    usb_com_isr();
-    usb_gen_isr();
+// Every OUT packet is answered with one IN report using this layout:
+//
+// data[0]: USB_CMD_INFO
+// data[1]: BOOTLOADER_VERSION
+// data[2]: CHIP_ID | BOOT_SIZE
+// data[3]: status of the command (USB_STATUS_*)
+// data[4:5]: BOOTLOADER_FEATURES
+// data[6:62]: command specific response data
+// data[63]: sequence tag copied from the OUT packet
+//
+// The response is built in place in the OUT packet buffer, so the sequence
+// tag in the last byte is sent back unchanged. This lets the host keep
+// several commands in flight and match the responses to them later.
+#define RESP_STATUS_POS 3
+#define RESP_FEATURES_POS 4
+#define RESP_DATA_POS 6
+#define SEQ_TAG_POS (EP_SIZE_VENDOR-1)
+
+// Size of the command header in OUT packets, the data starts after it
+#define SPM_HEADER_SIZE 6
+
+// Run an SPM command through `call_spm` and wait for it, see spm.S
+void spm_leap_cmd(uint16_t addr, uint8_t spmCmd, uint8_t spmCmd2, uint16_t optValue);
+#if USE_RWW_ISR
+// The same, but with SREG set to `sreg` while waiting for the RWW section
+void spm_rww_isr_cmd(
+    uint16_t addr, uint8_t spmCmd, uint8_t spmCmd2, uint16_t optValue,
+    uint8_t sreg
+);
+#endif
 
-    if (usb_is_endpoint_ready(EP_NUM_VENDOR_OUT)) {
-        uint8_t data[EP_OUT_SIZE_VENDOR];
-        usb_read_endpoint(
-            EP_NUM_VENDOR_OUT,
-            data
-        );
+// Tight loops that fill the temporary page buffer, see spm.S
+#if USE_SPM_FIFO
+void spm_fill_from_fifo(uint16_t address, uint8_t count);
+#endif
+#if USE_WRITE_PAGE
+void spm_fill_page(uint16_t address, const uint8_t *buf);
+#endif
 
-        uint8_t cmd = data[0];
-        // uint16_t address = *((uint16_t*)(data+1));
-        uint16_t address = (data[2]<<8) | data[1];
-        uint8_t size = data[5];
-
-        switch(cmd) {
-            // Format:
-            //
-            // data[0]: USB_CMD_SPM
-            // data[1:2]: spm Z address
-            // data[3]: spm action
-            // data[4]: spm action 2
-            // data[5]: repeat count
-            // data[6:7]: r0:r1 spm data
-            case USB_CMD_SPM: {
-                const uint8_t spm_action = data[3];
-                const uint8_t spm_action2 = data[4];
-                for (uint8_t i = 6; i < size; i+=2) {
-                    // const uint16_t spm_data = *((uint16_t*)&data[i]);
-                    const uint16_t spm_data = (data[i+1]<<8) | data[i];
-                    spm_leap_cmd(
-                        address+i - 6,
-                        spm_action,
-                        spm_action2,
-                        spm_data
-                    );
-                }
-            } break;
-
-            // data[0]: USB_CMD_WRITE_EEPROM
-            // data[1:2]: eeprom write start address
-            // data[3]: number of bytes to write
-            // data[4:...]: the data to be written
-            case USB_CMD_WRITE_EEPROM: {
-                for (uint8_t i = 6; i < size; ++i) {
-                    eeprom_write_byte((uint8_t*)address, data[i]);
-                    address++;
-                }
-            } break;
+#if USE_PERF_COUNTERS
+// Performance counters read with USB_CMD_STATS. Timer1 runs freely at
+// F_CPU/64 and is extended to 32 bits by perf_now(), which has to be called
+// at least once per overflow (262ms). The waits that are timed never take
+// that long, and usb_poll() calls it on every pass.
+#define PERF_TICK_US 4
+
+typedef struct {
+    uint32_t elapsed;       // timer ticks since the counters were cleared
+    uint32_t usb_idle;      // ticks in usb_poll() passes without a command
+    uint32_t spm_wait;      // ticks waiting for SPM erase/write to finish
+    uint32_t eeprom_wait;   // ticks waiting for EEPROM writes to finish
+    uint32_t packets;       // commands handled
+    uint32_t nak_in;        // passes where an IN token was NAKed
+    uint32_t nak_out;       // passes where an OUT token was NAKed
+    uint32_t wdt_resets;    // watchdog resets while handling commands
+} perf_counters_t;
+
+static perf_counters_t s_perf;
+static uint32_t s_perf_clock;
+static uint32_t s_perf_epoch;
+static uint16_t s_perf_last;
+
+static uint32_t perf_now(void) {
+    const uint16_t now = TCNT1;
+    s_perf_clock += (uint16_t)(now - s_perf_last);
+    s_perf_last = now;
+    return s_perf_clock;
+}
+
+/// Count the NAK flags of endpoint `ep` and clear them. The hardware only
+/// has one flag for each direction, so this counts the polls in which the
+/// host was NAKed at least once, not the individual tokens.
+static void perf_count_naks(uint8_t ep) {
+    UENUM = ep;
+    const uint8_t flags = UEINTX;
+    if (flags & (1<<NAKINI)) {
+        s_perf.nak_in++;
+    }
+    if (flags & (1<<NAKOUTI)) {
+        s_perf.nak_out++;
+    }
+    // writing 1 to the other flags leaves them unchanged
+    UEINTX = ~((1<<NAKINI) | (1<<NAKOUTI));
+}
+
+#define PERF_COUNT(name) (s_perf.name++)
+#define PERF_BEGIN() const uint32_t perf_start = perf_now()
+#define PERF_END(name) (s_perf.name += perf_now() - perf_start)
+
+/// spm_leap_cmd() with the time spent in it added to spm_wait
+static void spm_cmd(uint16_t addr, uint8_t spm_cmd1, uint8_t spm_cmd2, uint16_t value) {
+    PERF_BEGIN();
+    spm_leap_cmd(addr, spm_cmd1, spm_cmd2, value);
+    PERF_END(spm_wait);
+}
+#else
+#define PERF_COUNT(name)
+#define PERF_BEGIN()
+#define PERF_END(name)
+#define spm_cmd spm_leap_cmd
+#endif
+
+// What happened to a page written with USB_CMD_WRITE_PAGE, reported in
+// data[6] of the response.
+enum {
+    PAGE_RESULT_NONE = 0,       // the page hasn't been completely received yet
+    PAGE_RESULT_SKIPPED = 1,    // flash already holds the data
+    PAGE_RESULT_WRITTEN = 2,    // only bits were cleared, no erase needed
+    PAGE_RESULT_ERASED = 3,     // the page was erased and then written
+    PAGE_RESULT_QUEUED = 4,     // the page will be programmed in the background
+};
+
+#if USE_READ_CMD
+enum {
+    READ_SPACE_FLASH = 0,
+    READ_SPACE_EEPROM = 1,
+};
+
+// IN reports sent while streaming data for USB_CMD_READ use this layout:
+//
+// data[0]: USB_CMD_READ
+// data[1:2]: address of the first byte in this report
+// data[3]: number of data bytes in this report
+// data[4:63]: the data
+#define READ_DATA_POS 4
+#define READ_DATA_SIZE (EP_IN_SIZE_VENDOR - READ_DATA_POS)
+
+static uint16_t s_read_address;
+static uint16_t s_read_remaining;
+static uint8_t s_read_space;
+
+#if USE_BULK_ENDPOINTS
+// IN endpoint of the interface the read stream was started from
+static uint8_t s_read_ep_in;
+#else
+#define s_read_ep_in EP_NUM_VENDOR_IN
+#endif
+
+/// Send the next report of an active USB_CMD_READ stream
+static void usb_send_read_data(void) {
+    uint8_t data[EP_IN_SIZE_VENDOR];
+    uint8_t count = READ_DATA_SIZE;
+
+    if (s_read_remaining < count) {
+        count = s_read_remaining;
+    }
+
+    data[0] = USB_CMD_READ;
+    data[1] = LSB(s_read_address);
+    data[2] = MSB(s_read_address);
+    data[3] = count;
+    for (uint8_t i = 0; i < count; ++i) {
+        if (s_read_space == READ_SPACE_EEPROM) {
+            data[READ_DATA_POS+i] = eeprom_read_byte((uint8_t*)s_read_address);
+        } else {
+            data[READ_DATA_POS+i] = pgm_read_byte(s_read_address);
+        }
+        s_read_address++;
+    }
+    // don't leak stack contents after the end of a short final report
+    memset(data + READ_DATA_POS + count, 0, READ_DATA_SIZE - count);
+    s_read_remaining -= count;
+
+    usb_write_endpoint(
+        s_read_ep_in,
+        data
+    );
+}
+
+/// Send the next reports of an active USB_CMD_READ stream, returns false if
+/// there is no stream
+static bool usb_poll_read_stream(void) {
+    if (!s_read_remaining) {
+        return false;
+    }
+    for (uint8_t bank = 0; bank < EP_BANKS_VENDOR; ++bank) {
+        if (!s_read_remaining ||
+            !usb_is_endpoint_ready(s_read_ep_in)) {
+            break;
+        }
+        usb_send_read_data();
+    }
+    return true;
+}
+#endif
+
+#if USE_CRC_CMD
+// Number of page CRCs that fit in one response
+#define CRC_MAX_PAGES ((SEQ_TAG_POS - RESP_DATA_POS) / 4)
+
+/// CRC-32 (the one used by zlib, reflected polynomial 0xedb88320) of a range
+/// of flash.
+static uint32_t flash_crc32(uint16_t address, uint16_t length) {
+    uint32_t crc = 0xffffffff;
+    while (length--) {
+        crc ^= pgm_read_byte(address);
+        for (uint8_t i = 0; i < 8; ++i) {
+            if (crc & 1) {
+                crc = (crc >> 1) ^ 0xedb88320;
+            } else {
+                crc >>= 1;
+            }
+        }
+        address++;
+    }
+    return ~crc;
+}
+#endif
+
+#if USE_BOOT_SERVICES
+/// CRC-16/CCITT (polynomial 0x1021, initial value 0xffff) of a range of
+/// flash.
+static uint16_t flash_crc(uint16_t address, uint16_t length) {
+    uint16_t crc = 0xffff;
+    while (length--) {
+        crc = _crc_xmodem_update(crc, pgm_read_byte(address));
+        address++;
+    }
+    return crc;
+}
+#endif
+
+#if USE_EEPROM_UPDATE
+/// Program one EEPROM byte, skipping it if it already holds `value`.
+///
+/// The erase-only mode is used when the new value is 0xff, and the
+/// write-only mode when the new value only clears bits. Each of these takes
+/// about half the time of an atomic erase and write. Returns true if the byte
+/// was programmed.
+static bool eeprom_update(uint16_t address, uint8_t value) {
+    uint8_t mode;
+
+    {
+        PERF_BEGIN();
+        eeprom_busy_wait();
+        PERF_END(eeprom_wait);
+    }
+    EEAR = address;
+    EECR |= (1<<EERE);
+    const uint8_t old_value = EEDR;
+
+    if (old_value == value) {
+        return false;
+    } else if (value == 0xff) {
+        mode = (0<<EEPM1) | (1<<EEPM0); // erase only
+    } else if ((value & ~old_value) == 0) {
+        mode = (1<<EEPM1) | (0<<EEPM0); // write only
+    } else {
+        mode = (0<<EEPM1) | (0<<EEPM0); // erase and write
+    }
 
-            case USB_CMD_RESET: {
-                UDCON = 1;      // disconnect attach resistor
-                while(1); // wait for wdt to timeout to cause a reset
-            } break;
+    EEDR = value;
+    EECR = mode;
+    // EEPE must be set within 4 cycles of EEMPE
+    EECR |= (1<<EEMPE);
+    EECR |= (1<<EEPE);
+    return true;
+}
+#endif
 
-            default: {
-            } break;
+#if USE_EEPROM_QUEUE
+// EEPROM writes are queued here and programmed from the main loop one byte
+// at a time whenever EEPE is clear, so USB_CMD_WRITE_EEPROM can be answered
+// as soon as its data has been queued.
+#define EEPROM_QUEUE_SIZE 128
+// No new commands are taken while the queue has less room than this, so
+// the host is NAKed instead of having its data rejected
+#define EEPROM_QUEUE_PACKET_MAX (EP_OUT_SIZE_VENDOR - SPM_HEADER_SIZE)
+
+typedef struct {
+    uint16_t address;
+    uint8_t value;
+} eeprom_queue_entry_t;
+
+static eeprom_queue_entry_t s_eeprom_queue[EEPROM_QUEUE_SIZE];
+static uint8_t s_eeprom_queue_head;
+static uint8_t s_eeprom_queue_count;
+
+// number of bytes programmed, cleared by USB_CMD_SYNC
+static uint16_t s_eeprom_written;
+
+static void eeprom_queue_push(uint16_t address, uint8_t value) {
+    const uint8_t tail =
+        (s_eeprom_queue_head + s_eeprom_queue_count) & (EEPROM_QUEUE_SIZE-1);
+    s_eeprom_queue[tail].address = address;
+    s_eeprom_queue[tail].value = value;
+    s_eeprom_queue_count++;
+}
+
+/// Start programming the next queued byte if the EEPROM is idle. Bytes that
+/// don't need to change are skipped without waiting.
+static void eeprom_queue_poll(void) {
+    while (s_eeprom_queue_count && eeprom_is_ready()) {
+        const eeprom_queue_entry_t *entry = &s_eeprom_queue[s_eeprom_queue_head];
+        s_eeprom_queue_head = (s_eeprom_queue_head + 1) & (EEPROM_QUEUE_SIZE-1);
+        s_eeprom_queue_count--;
+        s_eeprom_written += eeprom_update(entry->address, entry->value);
+    }
+}
+
+/// Wait until all queued bytes have been programmed
+static void eeprom_queue_flush(void) {
+    PERF_BEGIN();
+    while (s_eeprom_queue_count) {
+        eeprom_queue_poll();
+        wdt_reset();
+    }
+    eeprom_busy_wait();
+    PERF_END(eeprom_wait);
+}
+#endif
+
+#if USE_WRITE_PAGE
+#if USE_PAGE_STAGING
+// Pages are received into one buffer while the page in the other buffer is
+// being programmed.
+#define PAGE_BUF_COUNT 2
+#else
+#define PAGE_BUF_COUNT 1
+#endif
+
+// Data for USB_CMD_WRITE_PAGE is collected here, and the flash page is only
+// touched once all of it has arrived.
+static uint8_t s_page_buf[PAGE_BUF_COUNT][SPM_PAGESIZE];
+
+#if USE_PAGE_STAGING
+// index of the buffer that USB_CMD_WRITE_PAGE data is written to
+static uint8_t s_rx_buf;
+#else
+#define s_rx_buf 0
+#endif
+
+/// Compare a page buffer with the flash page at `page_address` and decide
+/// what needs to be done to program it.
+///
+/// Nothing needs to be done if they already match, and the erase can be
+/// skipped if the new data only clears bits, since programming a page can
+/// only change bits from 1 to 0.
+static uint8_t flash_compare_page(uint16_t page_address, const uint8_t *buf) {
+    uint8_t result = PAGE_RESULT_SKIPPED;
+    for (uint16_t i = 0; i < SPM_PAGESIZE; ++i) {
+        const uint8_t old_byte = pgm_read_byte(page_address + i);
+        const uint8_t new_byte = buf[i];
+        if (new_byte & ~old_byte) {
+            result = PAGE_RESULT_ERASED;
+            break;
+        } else if (new_byte != old_byte) {
+            result = PAGE_RESULT_WRITTEN;
         }
+    }
+    return result;
+}
 
-        // load response value
-        data[0] = USB_CMD_INFO;
-        data[1] = BOOTLOADER_VERSION;
-        data[2] = CHIP_ID | BOOT_SIZE;
+#if !USE_PAGE_STAGING || USE_BOOT_SERVICES
+/// Program the flash page at `page_address` with the contents of `buf`,
+/// erasing it first only if needed. Returns PAGE_RESULT_*.
+///
+/// This is also a boot service, so it must not use any variables.
+static uint8_t flash_write_page(uint16_t page_address, const uint8_t *buf) {
+    const uint8_t result = flash_compare_page(page_address, buf);
 
-        usb_write_endpoint(
-            EP_NUM_VENDOR_IN,
-            data
+    if (result == PAGE_RESULT_SKIPPED) {
+        return result;
+    }
+
+    if (result == PAGE_RESULT_ERASED) {
+        spm_leap_cmd(
+            page_address,
+            (1<<SPMEN) | (1<<PGERS),
+            (1<<SPMEN) | (1<<RWWSRE),
+            0
         );
+    }
+    spm_fill_page(page_address, buf);
+    spm_leap_cmd(
+        page_address,
+        (1<<SPMEN) | (1<<PGWRT),
+        (1<<SPMEN) | (1<<RWWSRE),
+        0
+    );
+    return result;
+}
+#endif
+
+#if USE_PAGE_STAGING
+// Page staging: the bootloader runs from the NRWW section, so it can keep
+// servicing USB while a page in the RWW section is being erased or written.
+// Erase and write are started without waiting for them to finish, and
+// page_stage_poll() is called from the main loop to move on to the next step
+// once SPMEN clears. This hides the ~8ms erase+write time behind receiving
+// the next page.
+enum {
+    STAGE_IDLE,
+    STAGE_ERASING,
+    STAGE_WRITING,
+};
+
+static uint8_t s_stage_state;
+static uint16_t s_stage_address;    // page being programmed
+static bool s_stage_queued;         // s_rx_buf holds a complete page
+static uint16_t s_stage_queued_address;
+
+// number of pages handled for each PAGE_RESULT_*, cleared by USB_CMD_SYNC
+static uint16_t s_page_counts[PAGE_RESULT_ERASED+1];
+
+/// Fill the temporary page buffer from `buf` and start writing it.
+static void page_stage_write(const uint8_t *buf) {
+    spm_fill_page(s_stage_address, buf);
+    boot_spm_busy_wait();
+    boot_page_write(s_stage_address);
+    s_stage_state = STAGE_WRITING;
+}
+
+/// Start programming the queued page in `s_rx_buf`, and switch to receiving
+/// into the other buffer.
+static void page_stage_start(void) {
+    const uint8_t *buf = s_page_buf[s_rx_buf];
+    const uint8_t result = flash_compare_page(s_stage_queued_address, buf);
+
+    s_page_counts[result]++;
+    s_stage_address = s_stage_queued_address;
+    s_stage_queued = false;
+    s_rx_buf ^= 1;
+
+    if (result == PAGE_RESULT_ERASED) {
+        boot_page_erase(s_stage_address);
+        s_stage_state = STAGE_ERASING;
+    } else if (result == PAGE_RESULT_WRITTEN) {
+        page_stage_write(buf);
+    }
+}
+
+/// Advance page programming without blocking.
+static void page_stage_poll(void) {
+    if (boot_spm_busy()) {
+        return;
+    }
+
+    switch (s_stage_state) {
+        case STAGE_ERASING: {
+            // The erase doesn't touch the temporary buffer, and we don't
+            // re-enable the RWW section in between since that would clear it.
+            page_stage_write(s_page_buf[s_rx_buf ^ 1]);
+            return;
+        } break;
+
+        case STAGE_WRITING: {
+            boot_rww_enable();
+            boot_spm_busy_wait();
+            s_stage_state = STAGE_IDLE;
+        } break;
+    }
+
+    if (s_stage_queued) {
+        page_stage_start();
+    }
+}
+
+/// Wait until all staged pages have been programmed
+static void page_stage_flush(void) {
+    PERF_BEGIN();
+    while (s_stage_queued || s_stage_state != STAGE_IDLE) {
+        page_stage_poll();
+    }
+    PERF_END(spm_wait);
+}
+#endif
+
+/// Program the page that has been collected in the receive buffer, and
+/// store its PAGE_RESULT_* in `result`. Returns USB_STATUS_BAD_ARG without
+/// touching the flash if the page is in the boot section.
+static uint8_t page_buf_commit(uint16_t page_address, uint8_t *result) {
+    if (page_address >= BOOT_SECTION_START) {
+        return USB_STATUS_BAD_ARG;
+    }
+#if USE_PAGE_STAGING
+    s_stage_queued = true;
+    s_stage_queued_address = page_address;
+    page_stage_poll();
+    *result = PAGE_RESULT_QUEUED;
+#else
+    PERF_BEGIN();
+    *result = flash_write_page(page_address, s_page_buf[s_rx_buf]);
+    PERF_END(spm_wait);
+#endif
+    return USB_STATUS_OK;
+}
+#endif
+
+#if USE_BOOT_SERVICES
+// Services for the application, called through the table at the end of the
+// boot section, just below `call_spm`. See interface/kp_boot_32u4.h for the
+// application side.
+//
+// They run on the application's stack while its variables are in SRAM, so
+// they must not use any of the bootloader's variables.
+#define BOOT_SERVICE_MAGIC 0xb007
+#define BOOT_SERVICE_VERSION 1
+#define BOOT_SERVICE_COUNT (USE_RWW_ISR ? 3 : 2)
+
+uint8_t boot_service_write_page(uint16_t page_address, const uint8_t *buf);
+uint16_t boot_service_crc(uint16_t address, uint16_t length);
+void boot_service_spm(uint16_t address, uint8_t cmd1, uint8_t cmd2, uint16_t value);
+
+/// Program a whole page of the application section from SRAM, skipping the
+/// erase when possible. Interrupts are disabled while the RWW section is
+/// busy, since the application's vectors can't be read then. Returns
+/// PAGE_RESULT_*, or PAGE_RESULT_NONE if `page_address` isn't the start of
+/// a page in the application section.
+__attribute__((used))
+uint8_t boot_service_write_page(uint16_t page_address, const uint8_t *buf) {
+    if ((page_address & (SPM_PAGESIZE-1)) ||
+        page_address >= BOOT_SECTION_START) {
+        return PAGE_RESULT_NONE;
+    }
+    const uint8_t sreg = SREG;
+    cli();
+    const uint8_t result = flash_write_page(page_address, buf);
+    SREG = sreg;
+    return result;
+}
+
+/// CRC-16/CCITT of a range of flash
+__attribute__((used))
+uint16_t boot_service_crc(uint16_t address, uint16_t length) {
+    return flash_crc(address, length);
+}
+
+#if USE_RWW_ISR
+// While boot_service_spm() keeps the RWW section busy, the vectors are moved
+// to the table at the start of the boot section in early_boot.S, and these
+// handlers stand in for the application's. The
+// application describes what they should do in an rww_isr_t, and registers
+// its address in GPIOR1:GPIOR2. See kp_rww_isr_t in interface/kp_boot_32u4.h.
+//
+// data[0:1]: magic, RWW_ISR_MAGIC for this layout
+// data[2:3]: ticks, counts TIMER0_COMPA interrupts
+// data[4:5]: frames, counts USB start of frame interrupts
+// data[6]: in_ep, IN endpoint that `report` is sent on
+// data[7]: report_len
+// data[8]: report_pending, cleared once `report` has been sent
+// data[9:10]: report, address of the report in SRAM
+#define RWW_ISR_MAGIC 0x1a01
+
+typedef struct {
+    uint16_t magic;
+    uint16_t ticks;
+    uint16_t frames;
+    uint8_t in_ep;
+    uint8_t report_len;
+    uint8_t report_pending;
+    const uint8_t *report;
+} rww_isr_t;
+
+// Endpoints of the ATmega32u4
+#define RWW_ISR_EP_COUNT 7
+
+static inline
+volatile rww_isr_t *rww_isr_get(void) {
+    return (volatile rww_isr_t*)(GPIOR1 | (GPIOR2 << 8));
+}
+
+/// Returns the registered rww_isr_t, or NULL if GPIOR1:GPIOR2 don't point
+/// at one. The application may have used them for something else.
+static volatile rww_isr_t *rww_isr_find(void) {
+    volatile rww_isr_t *const isr = rww_isr_get();
+    if ((uint16_t)isr < RAMSTART ||
+        (uint16_t)isr > RAMEND - sizeof(rww_isr_t) + 1 ||
+        isr->magic != RWW_ISR_MAGIC) {
+        return NULL;
+    }
+    return isr;
+}
 
+/// Select the vector table, keeping the other bits of MCUCR. JTD also has a
+/// timed sequence, and writing it twice here would change it.
+static inline
+void rww_isr_set_ivsel(uint8_t mcucr) {
+    asm volatile (
+        "out %[reg], %[enable]\n\t"
+        "out %[reg], %[value]\n\t"
+        :
+        : [reg] "I" (_SFR_IO_ADDR(MCUCR)),
+          [enable] "r" ((uint8_t)(mcucr | (1<<IVCE))),
+          [value] "r" (mcucr)
+    );
+}
+
+/// Run an SPM command like `call_spm`. If the application has registered an
+/// rww_isr_t and interrupts are enabled, they are enabled while waiting for
+/// the RWW section, with the USB and Timer0 interrupts served by the
+/// handlers below. All the other USB interrupts are masked until the command
+/// is done. Otherwise interrupts are disabled for the whole command.
+__attribute__((used))
+void boot_service_spm(uint16_t address, uint8_t cmd1, uint8_t cmd2, uint16_t value) {
+    const uint8_t sreg = SREG;
+    cli();
+    volatile rww_isr_t *const isr = rww_isr_find();
+    if (isr == NULL) {
+        spm_leap_cmd(address, cmd1, cmd2, value);
+        SREG = sreg;
+        return;
+    }
+
+    uint8_t ueienx[RWW_ISR_EP_COUNT];
+    const uint8_t ep = UENUM;
+    const uint8_t udien = UDIEN;
+    const uint8_t mcucr = MCUCR;
+    for (uint8_t i = 0; i < RWW_ISR_EP_COUNT; ++i) {
+        UENUM = i;
+        ueienx[i] = UEIENX;
+        UEIENX = (i == isr->in_ep && isr->report_pending) ? (1<<TXINE) : 0;
+    }
+    UENUM = ep;
+    UDIEN = udien & (1<<SOFE);
+    rww_isr_set_ivsel(mcucr | (1<<IVSEL));
+
+    // returns with interrupts disabled
+    spm_rww_isr_cmd(address, cmd1, cmd2, value, sreg);
+
+    rww_isr_set_ivsel(mcucr);
+    for (uint8_t i = 0; i < RWW_ISR_EP_COUNT; ++i) {
+        UENUM = i;
+        UEIENX = ueienx[i];
+    }
+    UENUM = ep;
+    UDIEN = udien;
+    SREG = sreg;
+}
+
+ISR(TIMER0_COMPA_vect) {
+    rww_isr_get()->ticks++;
+}
+
+ISR(USB_GEN_vect) {
+    // only SOFE is left enabled, writing ones doesn't clear the other flags
+    UDINT = ~(1<<SOFI);
+    rww_isr_get()->frames++;
+}
+
+/// Sends the pending report once the host polls the endpoint for it. The
+/// application can't queue another one while it is waiting, so the
+/// endpoint interrupt is masked after that.
+ISR(USB_COM_vect) {
+    volatile rww_isr_t *const isr = rww_isr_get();
+    const uint8_t ep = UENUM;
+    UENUM = isr->in_ep;
+    if (isr->report_pending && (UEINTX & (1<<TXINI))) {
+        for (uint8_t i = 0; i < isr->report_len; ++i) {
+            UEDATX = isr->report[i];
+        }
+        // clears TXINI and FIFOCON, the same as usb_write_endpoint()
+        UEINTX = (1<<STALLEDI) | (1<<RXSTPI) | (1<<NAKOUTI) | (1<<RWAL);
+        isr->report_pending = 0;
+    }
+    UEIENX = 0;
+    UENUM = ep;
+}
+
+// Any other interrupt would jump to its vector in the busy RWW section.
+// Return without setting the I flag instead, so the rest of the command runs
+// with interrupts disabled. The application only sees the interrupt
+// afterwards if its flag stays set. Flags that are cleared when the vector
+// is taken, like those of the timer compare and overflow interrupts, are
+// lost.
+ISR(BADISR_vect, ISR_NAKED) {
+    asm volatile ("ret");
+}
+#endif
+
+// data[0:1]: BOOT_SERVICE_MAGIC
+// data[2]: BOOT_SERVICE_VERSION
+// data[3]: BOOT_SERVICE_COUNT
+// data[4:...]: a jmp to each service
+__attribute__((naked, used, section(".boot_service")))
+void boot_service_table(void) {
+    asm volatile (
+        ".word %[magic]\n\t"
+        ".byte %[version], %[count]\n\t"
+        "jmp boot_service_write_page\n\t"
+        "jmp boot_service_crc\n\t"
+#if USE_RWW_ISR
+        "jmp boot_service_spm\n\t"
+#endif
+        :
+        : [magic] "i" (BOOT_SERVICE_MAGIC),
+          [version] "i" (BOOT_SERVICE_VERSION),
+          [count] "i" (BOOT_SERVICE_COUNT)
+    );
+}
+#endif
+
+#if USE_WRITE_PAGE_LZ
+// Token format used by USB_CMD_WRITE_PAGE_LZ, each token starts with a
+// control byte `c`:
+//
+// c < 0x80: literal, the next c+1 bytes are copied to the page
+// c >= 0x80: match, copy (c&0x7f)+LZ_MIN_MATCH bytes from d+1 bytes back in
+//            the page, where d is the byte following c
+//
+// Matches may overlap the bytes they produce, so a distance of one repeats
+// a single byte.
+#define LZ_MIN_MATCH 3
+#define LZ_ERROR 0xffff
+
+/// Decode the tokens from `src` to `end` into the receive buffer, starting at
+/// `pos`. Returns the position after the last decoded byte, or LZ_ERROR if
+/// the tokens would read or write outside of their buffers.
+static uint16_t lz_decode(uint16_t pos, const uint8_t *src, const uint8_t *end) {
+    uint8_t *const page = s_page_buf[s_rx_buf];
+
+    while (src < end) {
+        const uint8_t c = *src++;
+        if (c < 0x80) {
+            const uint8_t len = c + 1;
+            if (len > end - src || pos + len > SPM_PAGESIZE) {
+                return LZ_ERROR;
+            }
+            memcpy(page + pos, src, len);
+            src += len;
+            pos += len;
+        } else {
+            const uint8_t len = (c & 0x7f) + LZ_MIN_MATCH;
+            if (src == end) {
+                return LZ_ERROR;
+            }
+            const uint16_t dist = *src++ + 1;
+            if (dist > pos || pos + len > SPM_PAGESIZE) {
+                return LZ_ERROR;
+            }
+            uint8_t *out = page + pos;
+            for (uint8_t i = 0; i < len; ++i) {
+                *out = *(out - dist);
+                out++;
+            }
+            pos += len;
+        }
+    }
+    return pos;
+}
+#endif
+
+/// Write the response header shared by all commands
+static void usb_fill_response(uint8_t *data, uint8_t status) {
+    data[0] = USB_CMD_INFO;
+    data[1] = BOOTLOADER_VERSION;
+    data[2] = CHIP_ID | BOOT_SIZE;
+    data[RESP_STATUS_POS] = status;
+    data[RESP_FEATURES_POS+0] = LSB(BOOTLOADER_FEATURES);
+    data[RESP_FEATURES_POS+1] = MSB(BOOTLOADER_FEATURES);
+}
+
+#if USE_CONTROL_PAGE
+// A whole page can be written with one control transfer by sending it as a
+// HID feature report to the vendor interface:
+//
+// data[0]: USB_CMD_WRITE_PAGE
+// data[1:2]: flash address of the page
+// data[3:5]: unused
+// data[6:6+SPM_PAGESIZE-1]: the page data
+//
+// Its response uses the same layout as the response to USB_CMD_WRITE_PAGE
+// and is read back by getting the feature report. It stays valid until the
+// next page is sent this way.
+static uint8_t s_control_page_resp[EP_IN_SIZE_VENDOR];
+
+/// Receive the data stage of a page SET_REPORT. The header goes to `header`
+/// and the page data straight into the receive buffer. Returns false if the
+/// host aborted the transfer.
+static bool usb_ep0_read_page(uint8_t *header) {
+    uint8_t *const page = s_page_buf[s_rx_buf];
+    uint16_t pos = 0;
+
+    while (pos < CONTROL_PAGE_REPORT_SIZE) {
+        uint8_t flags;
+        do {
+            flags = UEINTX;
+        } while (!(flags & ((1<<RXOUTI) | (1<<RXSTPI))));
+
+        if (flags & (1<<RXSTPI)) {
+            return false;
+        }
+
+        for (uint8_t count = UEBCLX; count; --count) {
+            const uint8_t byte = UEDATX;
+            if (pos < CONTROL_PAGE_HEADER_SIZE) {
+                header[pos] = byte;
+            } else if (pos < CONTROL_PAGE_REPORT_SIZE) {
+                page[pos - CONTROL_PAGE_HEADER_SIZE] = byte;
+            }
+            pos++;
+        }
+        UEINTX = ~(1<<RXOUTI);
+    }
+    return true;
+}
+
+static void usb_hid_feature_request(usb_request_t *req) {
+    if (req->val.wIndexLSB != INTERFACE_VENDOR ||
+        req->val.wValueMSB != HID_REPORT_TYPE_FEATURE) {
+        USB_EP0_STALL();
+        return;
+    }
+
+    switch (req->std.bRequest) {
+        case USB_REQ_HID_SET_REPORT: {
+            uint8_t header[CONTROL_PAGE_HEADER_SIZE];
+            uint8_t status = USB_STATUS_OK;
+
+            if (req->std.wLength != CONTROL_PAGE_REPORT_SIZE) {
+                USB_EP0_STALL();
+                return;
+            }
+
+            // same rules as for USB_CMD_WRITE_PAGE, the receive buffer must
+            // be free and no EEPROM writes may be in progress
+#if USE_EEPROM_QUEUE
+            eeprom_queue_flush();
+#endif
+#if USE_PAGE_STAGING
+            while (s_stage_queued) {
+                page_stage_poll();
+            }
+#endif
+
+            if (!usb_ep0_read_page(header)) {
+                return;
+            }
+            // status stage
+            usb_wait_in_ready();
+            usb_send_in();
+
+            const uint16_t address = (header[2]<<8) | header[1];
+            s_control_page_resp[RESP_DATA_POS] = PAGE_RESULT_NONE;
+            if (header[0] != USB_CMD_WRITE_PAGE ||
+                (address & (SPM_PAGESIZE-1))) {
+                status = USB_STATUS_BAD_ARG;
+            } else {
+                status = page_buf_commit(
+                    address, &s_control_page_resp[RESP_DATA_POS]
+                );
+            }
+            usb_fill_response(s_control_page_resp, status);
+        } break;
+
+        case USB_REQ_HID_GET_REPORT: {
+            usb_ep0_write(
+                s_control_page_resp,
+                sizeof(s_control_page_resp),
+                req->std.wLength
+            );
+        } break;
+
+        default: {
+            USB_EP0_STALL();
+        } break;
     }
 }
+#endif
+
+/// Handle the command waiting in the OUT endpoint `ep_out` and write the
+/// response to `ep_in`. Both the HID and bulk interfaces use this.
+static void usb_handle_cmd(uint8_t ep_out, uint8_t ep_in) {
+    uint8_t data[EP_OUT_SIZE_VENDOR];
+    uint8_t status = USB_STATUS_OK;
+    uint8_t pos;
+
+    BENCH_MARK(BENCH_MARK_CMD_START);
+    PERF_COUNT(packets);
+
+    // Read the header first, the rest of the packet may be consumed by the
+    // USB_CMD_SPM fast path below.
+    UENUM = ep_out;
+    for (pos = 0; pos < SPM_HEADER_SIZE; ++pos) {
+        data[pos] = UEDATX;
+    }
+
+    uint8_t cmd = data[0];
+    // uint16_t address = *((uint16_t*)(data+1));
+    uint16_t address = (data[2]<<8) | data[1];
+    uint8_t size = data[5];
+
+#if USE_PAGE_STAGING
+    // Everything other than more page data has to wait for the staged pages
+    // to be programmed, since flash can't be read and EEPROM can't be
+    // written while the RWW section is busy.
+    if (cmd != USB_CMD_WRITE_PAGE && cmd != USB_CMD_WRITE_PAGE_LZ) {
+        page_stage_flush();
+    }
+#endif
+
+#if USE_EEPROM_QUEUE
+    // Likewise for queued EEPROM writes. This also keeps EEPROM writes and
+    // SPM operations from overlapping.
+    if (cmd != USB_CMD_WRITE_EEPROM) {
+        eeprom_queue_flush();
+    }
+#endif
+
+#if USE_SPM_FIFO
+    // Filling the temporary page buffer is what old hosts send for every
+    // word of the application, so feed those words from the FIFO straight
+    // to SPM. This skips the copy to SRAM and the spm_leap_cmd() call for
+    // each word.
+    //
+    // Old hosts don't use the sequence tag and send 58 bytes of data, so
+    // their data runs to the end of the packet.
+    if (cmd == USB_CMD_SPM && data[3] == (1<<SPMEN) && data[4] == 0 &&
+        size > SPM_HEADER_SIZE && size <= EP_OUT_SIZE_VENDOR) {
+        const uint8_t words = (size - SPM_HEADER_SIZE) / 2;
+        spm_fill_from_fifo(address, words);
+        // the data isn't echoed back, don't send stack contents in its place
+        memset(data + pos, 0, 2 * words);
+        pos += 2 * words;
+        size = 0; // data already handled
+    }
+#endif
+
+    // the sequence tag at the end is still needed for the response
+    for (; pos < EP_OUT_SIZE_VENDOR; ++pos) {
+        data[pos] = UEDATX;
+    }
+    UEINTX = 0x6B;
+
+    switch(cmd) {
+        // Format:
+        //
+        // data[0]: USB_CMD_SPM
+        // data[1:2]: spm Z address
+        // data[3]: spm action
+        // data[4]: spm action 2
+        // data[5]: repeat count
+        // data[6:7]: r0:r1 spm data
+        //
+        // With USE_SPM_FIFO, page buffer fills are done by the fast path
+        // above, and `size` is 0 here.
+        case USB_CMD_SPM: {
+            const uint8_t spm_action = data[3];
+            const uint8_t spm_action2 = data[4];
+            for (uint8_t i = 6; i < size; i+=2) {
+                // const uint16_t spm_data = *((uint16_t*)&data[i]);
+                const uint16_t spm_data = (data[i+1]<<8) | data[i];
+                spm_cmd(
+                    address+i - 6,
+                    spm_action,
+                    spm_action2,
+                    spm_data
+                );
+            }
+        } break;
+
+        // With USE_EEPROM_UPDATE, bytes that already hold the right value are
+        // skipped.
+        //
+        // data[0]: USB_CMD_WRITE_EEPROM
+        // data[1:2]: eeprom write start address
+        // data[5]: end position of the data in the packet
+        // data[6:...]: the data to be written
+        //
+        // Response:
+        // data[6]: number of bytes that were actually programmed
+        //
+        // With the EEPROM queue, the data is only queued and data[6] is
+        // always 0, use USB_CMD_SYNC to get the number of bytes programmed.
+        // The packet is only taken once the queue has room for all of it,
+        // see usb_poll_cmds().
+        //
+        // data[7]: free space left in the EEPROM queue
+        case USB_CMD_WRITE_EEPROM: {
+#if USE_EEPROM_QUEUE
+            if (size > EP_OUT_SIZE_VENDOR) {
+                status = USB_STATUS_BAD_ARG;
+                break;
+            }
+            for (uint8_t i = 6; i < size; ++i) {
+                eeprom_queue_push(address, data[i]);
+                address++;
+            }
+            eeprom_queue_poll();
+            data[RESP_DATA_POS+0] = 0;
+            data[RESP_DATA_POS+1] = EEPROM_QUEUE_SIZE - s_eeprom_queue_count;
+#elif USE_EEPROM_UPDATE
+            uint8_t written = 0;
+            for (uint8_t i = 6; i < size; ++i) {
+                written += eeprom_update(address, data[i]);
+                address++;
+            }
+            data[RESP_DATA_POS] = written;
+#else
+            for (uint8_t i = 6; i < size; ++i) {
+                eeprom_write_byte((uint8_t*)address, data[i]);
+                address++;
+            }
+            // SPM can't start while the last byte is still being written
+            eeprom_busy_wait();
+#endif
+        } break;
+
+#if USE_ERASE_CMD
+        // Erase a range of flash pages. The watchdog is reset after each page
+        // so that erasing the whole application section doesn't trip it.
+        //
+        // data[0]: USB_CMD_ERASE
+        // data[1:2]: address of the first page
+        // data[6:7]: number of pages to erase
+        case USB_CMD_ERASE: {
+            uint16_t count = (data[7]<<8) | data[6];
+            address &= ~(SPM_PAGESIZE-1);
+            if ((uint32_t)address + (uint32_t)count*SPM_PAGESIZE >
+                BOOT_SECTION_START) {
+                status = USB_STATUS_BAD_ARG;
+                break;
+            }
+            while (count--) {
+                spm_cmd(
+                    address,
+                    (1<<SPMEN) | (1<<PGERS),
+                    (1<<SPMEN) | (1<<RWWSRE),
+                    0
+                );
+                address += SPM_PAGESIZE;
+                wdt_reset();
+                PERF_COUNT(wdt_resets);
+            }
+        } break;
+#endif
+
+#if USE_WRITE_PAGE
+        // Stream the data for a flash page. The bootloader erases and
+        // programs the page by itself once its last byte has been received.
+        //
+        // data[0]: USB_CMD_WRITE_PAGE
+        // data[1:2]: flash address of the first byte in this packet
+        // data[5]: end position of the data in the packet
+        // data[6:...]: the data to be written
+        //
+        // Response:
+        // data[6]: PAGE_RESULT_* for the page. With page staging the result
+        // is always PAGE_RESULT_QUEUED, use USB_CMD_SYNC to get the results.
+        case USB_CMD_WRITE_PAGE: {
+            const uint16_t offset = address & (SPM_PAGESIZE-1);
+            if (size < 6 || size > SEQ_TAG_POS ||
+                offset + (size-6) > SPM_PAGESIZE) {
+                status = USB_STATUS_BAD_ARG;
+                break;
+            }
+            memcpy(s_page_buf[s_rx_buf] + offset, data + 6, size - 6);
+            data[RESP_DATA_POS] = PAGE_RESULT_NONE;
+            if (offset + (size-6) == SPM_PAGESIZE) {
+                status = page_buf_commit(
+                    address - offset, &data[RESP_DATA_POS]
+                );
+            }
+        } break;
+#endif
+
+#if USE_WRITE_PAGE_LZ
+        // Same as USB_CMD_WRITE_PAGE, but the page data is compressed. Each
+        // packet holds whole tokens, and matches can refer to anything
+        // decoded earlier in the same page.
+        //
+        // data[0]: USB_CMD_WRITE_PAGE_LZ
+        // data[1:2]: flash address of the page
+        // data[3]: position in the page where this packet's data starts
+        // data[5]: end position of the data in the packet
+        // data[6:...]: compressed data
+        //
+        // Response:
+        // data[6]: PAGE_RESULT_* for the page, as for USB_CMD_WRITE_PAGE
+        case USB_CMD_WRITE_PAGE_LZ: {
+            uint16_t end = LZ_ERROR;
+            if (size >= 6 && size <= SEQ_TAG_POS &&
+                !(address & (SPM_PAGESIZE-1))) {
+                end = lz_decode(data[3], data + 6, data + size);
+            }
+            if (end == LZ_ERROR) {
+                status = USB_STATUS_BAD_ARG;
+                break;
+            }
+            data[RESP_DATA_POS] = PAGE_RESULT_NONE;
+            if (end == SPM_PAGESIZE) {
+                status = page_buf_commit(address, &data[RESP_DATA_POS]);
+            }
+        } break;
+#endif
+
+#if USE_READ_CMD
+        // Start streaming a range of flash or EEPROM to the host. After the
+        // response to this command, the bootloader sends back to back IN
+        // reports until the whole range has been sent, without waiting for
+        // any more OUT packets.
+        //
+        // data[0]: USB_CMD_READ
+        // data[1:2]: start address
+        // data[3]: READ_SPACE_FLASH or READ_SPACE_EEPROM
+        // data[6:7]: number of bytes to read
+        case USB_CMD_READ: {
+            if (data[3] > READ_SPACE_EEPROM) {
+                status = USB_STATUS_BAD_ARG;
+                break;
+            }
+            s_read_address = address;
+            s_read_space = data[3];
+#if USE_BULK_ENDPOINTS
+            s_read_ep_in = ep_in;
+#endif
+            s_read_remaining = (data[7]<<8) | data[6];
+        } break;
+#endif
+
+#if USE_CRC_CMD
+        // Compute the CRC of each page in a range of flash pages, so the
+        // host can work out which pages need to be written.
+        //
+        // data[0]: USB_CMD_CRC
+        // data[1:2]: address of the first page
+        // data[3]: number of pages, at most CRC_MAX_PAGES
+        //
+        // Response:
+        // data[6:...]: CRC-32 of each page, little endian. A 16 bit CRC
+        // would let the host skip one changed page in 65536.
+        case USB_CMD_CRC: {
+            const uint8_t count = data[3];
+            if (count > CRC_MAX_PAGES) {
+                status = USB_STATUS_BAD_ARG;
+                break;
+            }
+            address &= ~(SPM_PAGESIZE-1);
+            for (uint8_t i = 0; i < count; ++i) {
+                const uint32_t crc = flash_crc32(address, SPM_PAGESIZE);
+                memcpy(data + RESP_DATA_POS + 4*i, &crc, sizeof(crc));
+                address += SPM_PAGESIZE;
+            }
+        } break;
+#endif
+
+#if USE_SYNC_CMD
+        // Wait for all queued writes to finish. Returns how the writes done
+        // since the last USB_CMD_SYNC were handled.
+        //
+        // Response:
+        // data[6:7]: number of pages skipped
+        // data[8:9]: number of pages written without an erase
+        // data[10:11]: number of pages erased and written
+        // data[12:13]: number of EEPROM bytes programmed
+        case USB_CMD_SYNC: {
+#if USE_PAGE_STAGING
+            for (uint8_t i = 0; i < 3; ++i) {
+                const uint16_t count = s_page_counts[PAGE_RESULT_SKIPPED+i];
+                data[RESP_DATA_POS + 2*i + 0] = LSB(count);
+                data[RESP_DATA_POS + 2*i + 1] = MSB(count);
+                s_page_counts[PAGE_RESULT_SKIPPED+i] = 0;
+            }
+#endif
+#if USE_EEPROM_QUEUE
+            data[RESP_DATA_POS + 6] = LSB(s_eeprom_written);
+            data[RESP_DATA_POS + 7] = MSB(s_eeprom_written);
+            s_eeprom_written = 0;
+#endif
+        } break;
+#endif
+
+#if USE_PERF_COUNTERS
+        // Read and clear the performance counters. Times are in ticks of
+        // PERF_TICK_US microseconds.
+        //
+        // Response:
+        // data[6:9]: ticks since the counters were last cleared
+        // data[10:13]: ticks in usb_poll() passes that handled no command
+        // data[14:17]: ticks waiting for flash erase and write
+        // data[18:21]: ticks waiting for EEPROM writes
+        // data[22:25]: number of commands handled
+        // data[26:29]: number of polls where the host got a NAK on IN
+        // data[30:33]: number of polls where the host got a NAK on OUT
+        // data[34:37]: number of watchdog resets while handling commands
+        case USB_CMD_STATS: {
+            const uint32_t now = perf_now();
+            s_perf.elapsed = now - s_perf_epoch;
+            memcpy(data + RESP_DATA_POS, &s_perf, sizeof(s_perf));
+            memset(&s_perf, 0, sizeof(s_perf));
+            s_perf_epoch = now;
+        } break;
+#endif
+
+        // Reset into the application. main() has set MAGIC_ENTER_APPL, so
+        // the watchdog reset starts it. The shortest timeout is used instead
+        // of the 0.5s one set in main(), which only guards against hangs.
+        // early_boot.S turns the watchdog off before starting the
+        // application.
+        case USB_CMD_RESET: {
+            wdt_enable(WDTO_15MS);
+            UDCON = 1;      // disconnect attach resistor
+            // wait for wdt to timeout to cause a reset
+            while (UDCON & (1<<DETACH));
+        } break;
 
-static void spm_leap_cmd(uint16_t addr, uint8_t spmCmd, uint8_t spmCmd2, uint16_t optValue) {
-    asm volatile(
-        "push r10\n"
-        "push r11\n"
-        "push r0\n"
-        "push r1\n"
-        "push r30\n"
-        "push r31\n"
-
-        // NOTE: bootloader always waits after executing the SPM instruction,
-        // so don't need to check it here.
-
-        // For the `call_spm_fn` function, the following registers are used
-        // * Z[r30:r31]: word address which the command will operate on
-        // * [r0:r1]: optional value used by the command
-        // * r20: command value loaded into the SPMCSR register
-        "movw r0, %[optValue] \n" // set the value to be written
-        "mov r10, %[spmCmd]\n"    // SPMCSR value
-        "mov r11, %[spmCmd2]\n"    // SPMCSR value
-        "mov r30, %A[addr]\n"
-        "mov r31, %B[addr]\n"
-
-        "call call_spm\n"
-
-        // Return from the bootloader, pop values from stack and return
-        "pop r31\n"
-        "pop r30\n"
-        "pop r1\n"
-        "pop r0\n"
-        "pop r11\n"
-        "pop r10\n"
-            // output registers
-            : "=r" (addr)                                   // %0
-            // input registers
-            : [spmCmd] "r" (spmCmd),                        // %1
-              [spmCmd2] "r" (spmCmd2),                      // %2
-              [optValue] "r" (optValue),                    // %3
-              [addr] "0" (addr),                            // %4
-              [SPM_CSR] "I" (_SFR_IO_ADDR(SPMCSR))          // %5
+        case USB_CMD_VERSION:
+        case USB_CMD_INFO: {
+        } break;
+
+        default: {
+            status = USB_STATUS_UNKNOWN_CMD;
+        } break;
+    }
+
+    usb_fill_response(data, status);
+    usb_write_endpoint(
+        ep_in,
+        data
     );
+    BENCH_MARK(BENCH_MARK_CMD_END);
+}
+
+/// Handle the commands waiting on one interface
+static void usb_poll_cmds(uint8_t ep_out, uint8_t ep_in) {
+    // The vendor endpoints are double buffered, so the host may have a
+    // packet waiting in each bank. Handle all of them before returning.
+    //
+    // Only accept a new command when there is room for its response in the
+    // IN endpoint, otherwise we would overwrite a response that the host
+    // hasn't read yet.
+    for (uint8_t bank = 0; bank < EP_BANKS_VENDOR; ++bank) {
+        if (!usb_is_endpoint_ready(ep_out) ||
+            !usb_is_endpoint_ready(ep_in)) {
+            break;
+        }
+#if USE_PAGE_STAGING
+        // both page buffers are in use, wait for the current page to finish
+        if (s_stage_queued) {
+            break;
+        }
+#endif
+#if USE_READ_CMD
+        // a command started a read stream, it has to finish first
+        if (s_read_remaining) {
+            break;
+        }
+#endif
+#if USE_EEPROM_QUEUE
+        // Leave the packet in the endpoint until the queue can take it. The
+        // command can't be read without taking the packet, so this holds
+        // back every command, not only USB_CMD_WRITE_EEPROM. Nothing is lost
+        // by that: usb_handle_cmd() empties the queue before any other
+        // command anyway, so they would wait for it there instead.
+        if (EEPROM_QUEUE_SIZE - s_eeprom_queue_count < EEPROM_QUEUE_PACKET_MAX) {
+            break;
+        }
+#endif
+        usb_handle_cmd(ep_out, ep_in);
+        wdt_reset();
+        PERF_COUNT(wdt_resets);
+    }
+}
+
+void usb_poll(void) {
+    BENCH_MARK(BENCH_MARK_POLL_START);
+#if USE_PERF_COUNTERS
+    const uint32_t pass_start = perf_now();
+    const uint32_t pass_packets = s_perf.packets;
+
+    // before the command handlers, which clear the flags when they use the
+    // endpoints
+    perf_count_naks(EP_NUM_VENDOR_IN);
+    perf_count_naks(EP_NUM_VENDOR_OUT);
+#if USE_BULK_ENDPOINTS
+    perf_count_naks(EP_NUM_BULK_IN);
+    perf_count_naks(EP_NUM_BULK_OUT);
+#endif
+#endif
+    usb_com_isr();
+    usb_gen_isr();
+
+#if USE_PAGE_STAGING
+    page_stage_poll();
+#endif
+
+#if USE_EEPROM_QUEUE
+    eeprom_queue_poll();
+#endif
+
+    bool streaming = false;
+#if USE_READ_CMD
+    // Don't accept new commands until an active read stream has finished
+    streaming = usb_poll_read_stream();
+#endif
+
+    if (!streaming) {
+        usb_poll_cmds(EP_NUM_VENDOR_OUT, EP_NUM_VENDOR_IN);
+#if USE_BULK_ENDPOINTS
+        usb_poll_cmds(EP_NUM_BULK_OUT, EP_NUM_BULK_IN);
+#endif
+    }
+#if USE_PERF_COUNTERS
+    // USB_CMD_STATS clears the counters, so compare instead of subtracting.
+    // A pass that sends read data isn't idle either.
+    if (!streaming && s_perf.packets == pass_packets) {
+        s_perf.usb_idle += perf_now() - pass_start;
+    }
+#endif
+    BENCH_MARK(BENCH_MARK_POLL_END);
+}
+
+#if USE_USB_INTERRUPTS
+// The interrupts only wake up the CPU. They mask the events that fired and
+// leave the work to usb_poll(), so all the USB handling still runs with
+// interrupts disabled from the main loop.
+ISR(USB_GEN_vect) {
+    UDIEN = 0;
+}
+
+ISR(USB_COM_vect) {
+    const uint8_t ep = UENUM;
+    const uint8_t ep_irqs = UEINT;
+    for (uint8_t i = 0; i <= MAX_EP_NUM_USED; ++i) {
+        if (ep_irqs & (1<<i)) {
+            UENUM = i;
+            UEIENX = 0;
+        }
+    }
+    UENUM = ep;
 }
+
+/// Returns true if usb_poll() has nothing to do until the next USB event
+static bool usb_is_idle(void) {
+#if USE_READ_CMD
+    if (s_read_remaining) {
+        return false;
+    }
+#endif
+#if USE_PAGE_STAGING
+    if (s_stage_queued || s_stage_state != STAGE_IDLE) {
+        return false;
+    }
+#endif
+#if USE_EEPROM_QUEUE
+    if (s_eeprom_queue_count) {
+        return false;
+    }
+#endif
+    // A command may be waiting for the host to read the previous response
+    if (usb_is_endpoint_ready(EP_NUM_VENDOR_OUT)) {
+        return false;
+    }
+#if USE_BULK_ENDPOINTS
+    if (usb_is_endpoint_ready(EP_NUM_BULK_OUT)) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+void usb_sleep(void) {
+    if (!s_sof_seen || !usb_is_idle()) {
+        return;
+    }
+    s_sof_seen = false;
+
+    // Unmask the events that should wake us up. If one of them has already
+    // happened, its interrupt fires as soon as they are enabled below and
+    // the CPU wakes up straight away.
+    UDIEN = (1<<EORSTE) | (1<<SOFE);
+    UENUM = 0;
+    UEIENX = (1<<RXSTPE);
+    UENUM = EP_NUM_VENDOR_OUT;
+    UEIENX = (1<<RXOUTE);
+#if USE_BULK_ENDPOINTS
+    UENUM = EP_NUM_BULK_OUT;
+    UEIENX = (1<<RXOUTE);
+#endif
+
+    PERF_BEGIN();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    // the instruction after sei is always executed, so no interrupt can be
+    // lost between enabling them and going to sleep
+    sei();
+    sleep_cpu();
+    cli();
+    sleep_disable();
+    PERF_END(usb_idle);
+}
+#endif
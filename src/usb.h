@@ -9,11 +9,19 @@
 void usb_init(void);			// initialize everything
 uint8_t usb_configured(void);		// is the USB port configured
 void usb_poll(void);
+#if USE_USB_INTERRUPTS
+void usb_sleep(void);   // sleep until the next USB event
+#endif
 
 
 #define ENDPOINT0_SIZE      64
 #define DEFAULT_BUFFERING   EP_SINGLE_BUFFER
 
+// The vendor endpoints use two banks, so the next packet can be received
+// while the current one is being processed.
+#define EP_BUFFERING_VENDOR EP_DOUBLE_BUFFER
+#define EP_BANKS_VENDOR     2
+
 #define EP_TYPE_CONTROL			0x00
 #define EP_TYPE_BULK_IN			0x81
 #define EP_TYPE_BULK_OUT		0x80
@@ -3,6 +3,10 @@
 
 #pragma once
 
+#include <avr/io.h>
+
+#include "config.h"
+
 #include "usb/util/descriptor_defs.h"
 #include "usb/util/requests.h"
 
@@ -13,16 +17,32 @@ typedef struct usb_config_desc_keyboard_t {
     usb_hid_desc_t hid3;
     usb_endpoint_desc_t ep4in;
     usb_endpoint_desc_t ep4out;
+
+#if USE_BULK_ENDPOINTS
+    usb_interface_desc_t intf_bulk;
+    usb_endpoint_desc_t ep_bulk_in;
+    usb_endpoint_desc_t ep_bulk_out;
+#endif
 } usb_config_desc_keyboard_t;
 
 // endpoint and interface numbers
 #define INTERFACE_VENDOR 0
+#if USE_BULK_ENDPOINTS
+// Vendor class interface with bulk endpoints that accepts the same commands
+// as the HID interface. Hosts that can use libusb get more than one packet
+// per frame through it.
+#define INTERFACE_BULK 1
+#define NUM_INTERFACES (INTERFACE_BULK+1)
+#else
 #define NUM_INTERFACES (INTERFACE_VENDOR+1)
+#endif
 
 // On some ports (atmega32u4), the USB hardware must assign IN and OUT endpoints
 // to separate ENDPOINT numbers.
 #  define EP_NUM_VENDOR_IN        1
 #  define EP_NUM_VENDOR_OUT       2
+#  define EP_NUM_BULK_IN          3
+#  define EP_NUM_BULK_OUT         4
 
 // endpoint sizes
 #define EP_SIZE_VENDOR 0x40
@@ -34,6 +54,13 @@ typedef struct usb_config_desc_keyboard_t {
 #define EP_OUT_SIZE_BOOT_KEYBOARD   0
 #define EP_OUT_SIZE_VENDOR          EP_SIZE_VENDOR
 
+// The bulk endpoints use the same packet layout as the HID reports
+#define EP_SIZE_BULK EP_SIZE_VENDOR
+
+// Feature report used to write a whole page with one control transfer
+#define CONTROL_PAGE_HEADER_SIZE 6
+#define CONTROL_PAGE_REPORT_SIZE (CONTROL_PAGE_HEADER_SIZE + SPM_PAGESIZE)
+
 #define EP0_IN_SIZE EP0_SIZE
 #define EP1_IN_SIZE EP_IN_SIZE_BOOT_KEYBOARD
 #define EP4_IN_SIZE EP_IN_SIZE_VENDOR
@@ -54,6 +81,9 @@ typedef struct usb_config_desc_keyboard_t {
 #define STRING_DESC_MANUFACTURER 1
 #define STRING_DESC_PRODUCT 2
 #define STRING_DESC_SERIAL_NUMBER 3
+#elif USE_SERIAL_NUMBER
+#define USB_STRING_DESC_COUNT 2
+#define STRING_DESC_SERIAL_NUMBER 3
 #else
 #define USB_STRING_DESC_COUNT 0
 #endif
@@ -66,3 +96,6 @@ extern const uint8_t sizeof_hid_desc_boot_keyboard;
 extern const uint8_t hid_desc_boot_keyboard[];
 extern const uint8_t sizeof_hid_desc_vendor;
 extern const uint8_t hid_desc_vendor[];
+#if USE_SERIAL_NUMBER
+extern const uint16_t usb_string_desc_0[2];
+#endif
@@ -28,7 +28,11 @@ const usb_device_desc_t usb_device_desc = {
 #if 1
     .iManufacturer      = 0,
     .iProduct           = 0,
+#if USE_SERIAL_NUMBER
+    .iSerialNumber      = STRING_DESC_SERIAL_NUMBER,
+#else
     .iSerialNumber      = 0,
+#endif
 #else
     .iManufacturer      = STRING_DESC_MANUFACTURER,
     .iProduct           = STRING_DESC_PRODUCT,
@@ -90,15 +94,50 @@ const usb_config_desc_keyboard_t usb_config_desc = {
         .wMaxPacketSize   = EP_SIZE_VENDOR,
         .bInterval        = REPORT_INTERVAL_VENDOR_OUT,
     },
+
+#if USE_BULK_ENDPOINTS
+    // bulk interface descriptor
+    {
+        .bLength            = sizeof(usb_interface_desc_t),
+        .bDescriptorType    = USB_DESC_INTERFACE,
+        .bInterfaceNumber   = INTERFACE_BULK,
+        .bAlternateSetting  = 0,
+        .bNumEndpoints      = 2,
+        .bInterfaceClass    = USB_CLASS_VENDOR,
+        .bInterfaceSubClass = 0,
+        .bInterfaceProtocol = 0,
+        .iInterface         = STRING_DESC_NONE,
+    },
+    // endpoint descriptor bulk in
+    {
+        .bLength          = sizeof(usb_endpoint_desc_t),
+        .bDescriptorType  = USB_DESC_ENDPOINT,
+        .bEndpointAddress = USB_DIR_IN | EP_NUM_BULK_IN,
+        .bmAttributes     = USB_EP_TYPE_BULK,
+        .wMaxPacketSize   = EP_SIZE_BULK,
+        .bInterval        = 0,
+    },
+    // endpoint descriptor bulk out
+    {
+        .bLength          = sizeof(usb_endpoint_desc_t),
+        .bDescriptorType  = USB_DESC_ENDPOINT,
+        .bEndpointAddress = USB_DIR_OUT | EP_NUM_BULK_OUT,
+        .bmAttributes     = USB_EP_TYPE_BULK,
+        .wMaxPacketSize   = EP_SIZE_BULK,
+        .bInterval        = 0,
+    },
+#endif
 };
 
-#if 0
+#if USE_SERIAL_NUMBER
 // language id in string 0 descriptor
 const uint16_t usb_string_desc_0[2] = {
     USB_STRING_DESC_SIZE(sizeof(usb_string_desc_0)),
     HID_LANG_ID(HID_LANG_ENGLISH, HID_SUBLANG_ENGLISH_US),
 };
+#endif
 
+#if 0
 // language id in string 0 descriptor
 const uint16_t usb_string_desc_1[8] = {
     USB_STRING_DESC_SIZE(sizeof(usb_string_desc_1)),
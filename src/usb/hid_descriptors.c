@@ -8,6 +8,7 @@
 #define HID_USAGE_VENDOR_0 0x80+0
 #define HID_USAGE_VENDOR_1 0x80+1
 #define HID_USAGE_VENDOR_2 0x80+2
+#define HID_USAGE_VENDOR_3 0x80+3
 
 // Note: For HID_LOGICAL_MAXIMUM=255, we use the value 0x00ff instead of 0xff.
 // This is because the integers used in logical min/max values are assumed
@@ -30,6 +31,12 @@ const uint8_t hid_desc_vendor[] = {
         // HID_REPORT_COUNT(1)    , 64, // Reuse global item
         HID_USAGE(1)           , HID_USAGE_VENDOR_2,
         HID_OUTPUT(1)          , IOF_DATA | IOF_VARIABLE | IOF_ABSOLUTE,
+#if USE_CONTROL_PAGE
+        // Vendor feature usage, holds a whole flash page:
+        HID_REPORT_COUNT(2)    , DB16(CONTROL_PAGE_REPORT_SIZE),
+        HID_USAGE(1)           , HID_USAGE_VENDOR_3,
+        HID_FEATURE(1)         , IOF_DATA | IOF_VARIABLE | IOF_ABSOLUTE,
+#endif
     HID_END_COLLECTION(0),
 };
 
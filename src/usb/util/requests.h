@@ -47,6 +47,11 @@
 #define USB_REQ_HID_SET_IDLE      0x0a
 #define USB_REQ_HID_SET_PROTOCOL  0x0b
 
+// HID report types (MSB of wValue for GET_REPORT/SET_REPORT)
+#define HID_REPORT_TYPE_INPUT     0x01
+#define HID_REPORT_TYPE_OUTPUT    0x02
+#define HID_REPORT_TYPE_FEATURE   0x03
+
 
 typedef struct {
     uint8_t   bmRequestType;